@@ -26,12 +26,14 @@
 #include <iterator>
 #include <chrono>
 #include <thread>
+#include <mutex>
 #include <random>
 #include <memory>
 #include <algorithm>
 #include "src/utils/Vec3.h"
 #include "src/render/Camera.h"
 #include "src/render/Scene.h"
+#include "src/render/AccelerationCache.h"
 #include <GL/glut.h>
 
 #include "src/render/Renderer.h"
@@ -79,6 +81,9 @@ void printUsage () {
          << " w: Toggle Wireframe Mode" << endl
          << " g: Toggle Gouraud Shading Mode" << endl
          << " f: Toggle full screen mode" << endl
+         << " v: Toggle wavefront ray tracing" << endl
+         << " a: Toggle adaptive sampling" << endl
+         << " s: Next sampler (independent, stratified, Sobol, blue noise)" << endl
          << " <drag>+<left button>: rotate model" << endl
          << " <drag>+<right button>: move model" << endl
          << " <drag>+<middle button>: zoom" << endl
@@ -128,6 +133,11 @@ void clear () {
 
 unsigned int realtime_texture;
 
+// the realtime image is refined by its own thread while the window keeps drawing, the texture shows its last pass
+static std::thread realtime_thread;
+static std::mutex realtime_mutex;
+static std::vector< Color > realtime_image;
+
 void setup_renderer(){
     /*
     renderer = Renderer(
@@ -138,6 +148,7 @@ void setup_renderer(){
         480, 480,
         100
     );
+    renderer.adaptive_threshold = 0.005f; // about a unit of the 8 bit output
     renderer << postprocess::color::Vignette::create(0.0, 0.7)
         << postprocess::color::Value::create(1.3)
 
@@ -146,10 +157,11 @@ void setup_renderer(){
     //renderer << postprocess::utils::Depth::create();
     realtime_renderer = Renderer(
         360, 360,
-        1
+        64 // accumulated over the frames while the camera doesn't move, a sample per frame
     );
     realtime_renderer.silent = true;
     realtime_renderer << postprocess::denoise::Similarity::create(1.0);
+    realtime_image = realtime_renderer.getImage();
 
     // for realtime
     glEnable(GL_TEXTURE_2D);
@@ -161,13 +173,38 @@ void setup_renderer(){
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 }
 
+static CameraView realtime_view;
+static int realtime_scene = -1; // -1 restarts the realtime render on the next frame
+
+void stopRealtime(){
+    realtime_renderer.cancel();
+    if (realtime_thread.joinable()) realtime_thread.join();
+}
+
 void drawRealtimeRT(){ // https://stackoverflow.com/questions/31482816/opengl-is-there-an-easier-way-to-fill-window-with-a-texture-instead-using-vbo
-    
+    camera.apply();
+    CameraView view = CameraView::fromOpenGL();
+
+    // start over when anything moved, otherwise the thread keeps refining what's already there, a sample per pass
+    if (view != realtime_view || (int)selected_scene != realtime_scene){
+        stopRealtime();
+        realtime_renderer.resetAccumulation();
+        realtime_view = view;
+        realtime_scene = selected_scene;
+        realtime_thread = std::thread([](){
+            realtime_renderer.renderProgressive(realtime_view, scenes[realtime_scene], 1, 0.0, [](unsigned int){
+                std::lock_guard< std::mutex > lock(realtime_mutex);
+                realtime_image = realtime_renderer.getImage();
+            });
+        });
+    }
 
-    realtime_renderer.render(camera, scenes[selected_scene], false);
     glEnable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, realtime_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, realtime_renderer.w, realtime_renderer.h, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*)realtime_renderer.getImage().data());
+    {
+        std::lock_guard< std::mutex > lock(realtime_mutex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, realtime_renderer.w, realtime_renderer.h, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*)realtime_image.data());
+    }
     
     //matrix fuckery needed to shoo all the current scene and camera transforms
     glPushMatrix();
@@ -271,12 +308,35 @@ void key (unsigned char keyPressed, int x, int y) {
 
     case 'r':
         rays.clear();
+        stopRealtime(); // both would share the thread pool
+        realtime_scene = -1;
         renderer.render(camera, scenes[selected_scene]);
         last_action_is_scene_changed = false;
         break;
     case 'y':
         realtime = !realtime;
+        if (!realtime){
+            stopRealtime();
+            realtime_scene = -1;
+        }
+        break;
+    case 'v':
+        renderer.wavefront = !renderer.wavefront;
+        cout << "Wavefront rendering " << (renderer.wavefront ? "on" : "off") << endl;
         break;
+    case 'a':
+        renderer.adaptive_threshold = renderer.adaptive_threshold > 0.0f ? 0.0f : 0.005f;
+        cout << "Adaptive sampling " << (renderer.adaptive_threshold > 0.0f ? "on" : "off") << endl;
+        break;
+    case 's': {
+        static const char * sampler_names[] = {"independent", "stratified", "Sobol", "blue noise"};
+        renderer.sampler_type = (SamplerType)((renderer.sampler_type + 1) % 4);
+        stopRealtime(); // its thread reads the sampler type
+        realtime_renderer.sampler_type = renderer.sampler_type;
+        realtime_scene = -1;
+        cout << "Sampler: " << sampler_names[renderer.sampler_type] << endl;
+        break;
+    }
     
     case '+':
         selected_scene = (selected_scene+1) % scenes.size();
@@ -395,8 +455,10 @@ int main (int argc, char ** argv) {
     camera.move(0., 0., -3.1);
 
     setup_renderer();
+    atexit(stopRealtime); // exit() while the realtime thread runs would destroy it still joinable
 
     selected_scene=0;
+    accelerationCache::directory = "cache/"; // big trees are saved there and loaded back on the next runs
     scenes = getScenes();
     scenes[selected_scene].print_scene_data(false);
     
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cfloat>
+#include <cmath>
+#include "src/utils/Vec3.h"
+#include "src/utils/Ray.h"
+#include "Mesh.h"
+#include "Triangle.h"
+#include <GL/glut.h>
+
+
+// A placed copy of one of the Scene's prototypes. Only a 3x4 transform is stored, the triangles stay in the
+// prototype (object space), so a hundred copies of a mesh cost a hundred transforms and not a hundred meshes.
+// Transformations are applied in call order, like on a Mesh.
+class MeshInstance {
+protected:
+    // world = linear * object + translation
+    Mat3 linear = Mat3(1., 0., 0., 0., 1., 0., 0., 0., 1.);
+    Vec3 translation = Vec3(0., 0., 0.);
+
+    // kept up to date by every transformation, rays are brought to object space way more often than the instance moves
+    Mat3 inverse_linear = Mat3(1., 0., 0., 0., 1., 0., 0., 0., 1.);
+    Mat3 normal_matrix = Mat3(1., 0., 0., 0., 1., 0., 0., 0., 1.); // inverse transpose
+
+    void apply_transformation_matrix( const Mat3 & transform ){
+        linear = transform * linear;
+        translation = transform * translation;
+
+        inverse_linear = linear.getInverse();
+        normal_matrix = inverse_linear.getTranspose();
+    }
+
+public:
+    unsigned int prototype = 0; // index in Scene::prototypes
+    int material_id;
+
+    void translate( Vec3 const & t ){
+        translation += t;
+    }
+
+    void scale( Vec3 const & scale ){
+        apply_transformation_matrix(Mat3(scale[0], 0., 0.,
+                                         0., scale[1], 0.,
+                                         0., 0., scale[2]));
+    }
+
+    void rotate_x ( float angle ){
+        float x_angle = angle * M_PI / 180.;
+        apply_transformation_matrix(Mat3(1., 0., 0.,
+                                         0., cos(x_angle), -sin(x_angle),
+                                         0., sin(x_angle), cos(x_angle)));
+    }
+
+    void rotate_y ( float angle ){
+        float y_angle = angle * M_PI / 180.;
+        apply_transformation_matrix(Mat3(cos(y_angle), 0., sin(y_angle),
+                                         0., 1., 0.,
+                                         -sin(y_angle), 0., cos(y_angle)));
+    }
+
+    void rotate_z ( float angle ){
+        float z_angle = angle * M_PI / 180.;
+        apply_transformation_matrix(Mat3(cos(z_angle), -sin(z_angle), 0.,
+                                         sin(z_angle), cos(z_angle), 0.,
+                                         0., 0., 1.));
+    }
+
+    inline Vec3 toWorld( Vec3 const & p ) const {
+        return linear * p + translation;
+    }
+
+    // the same ray in object space. Its direction gets normalized by Ray, so distances differ: t_object = t_world * t_scale
+    inline Ray toObjectSpace( Ray const & r, float & t_scale ) const {
+        Vec3 d = inverse_linear * r.direction();
+        t_scale = d.length();
+        return Ray(inverse_linear * (r.origin() - translation), d);
+    }
+
+    // brings a hit found with toObjectSpace(world_ray) back in the world
+    inline void toWorldSpace( RayTriangleIntersection & hit, Ray const & world_ray, float t_scale ) const {
+        hit.t /= t_scale;
+        hit.intersection = world_ray.at(hit.t);
+        hit.normal = normal_matrix * hit.normal;
+        hit.normal.normalize();
+    }
+
+    // world box around an object space box
+    void transformAABB( Vec3 const & v1, Vec3 const & v2, Vec3 & res1, Vec3 & res2 ) const {
+        res1 = Vec3(FLT_MAX);
+        res2 = Vec3(-FLT_MAX);
+        for (int c = 0; c < 8; ++c){
+            Vec3 corner = toWorld(Vec3(
+                (c & 1) ? v2[0] : v1[0],
+                (c & 2) ? v2[1] : v1[1],
+                (c & 4) ? v2[2] : v1[2]
+            ));
+            for (int k = 0; k < 3; ++k){
+                res1[k] = std::min(res1[k], corner[k]);
+                res2[k] = std::max(res2[k], corner[k]);
+            }
+        }
+    }
+
+    // linear version, when no acceleration structure holds the instances
+    RayTriangleIntersection intersect( Ray const & r, const Mesh & mesh ) const {
+        float t_scale;
+        RayTriangleIntersection hit = mesh.intersect(toObjectSpace(r, t_scale));
+        if (hit.intersectionExists) toWorldSpace(hit, r, t_scale);
+        return hit;
+    }
+
+    void draw( const Mesh & mesh, const Material & material ) const {
+        GLfloat transform[16] = { // column major
+            linear(0, 0), linear(1, 0), linear(2, 0), 0.0f,
+            linear(0, 1), linear(1, 1), linear(2, 1), 0.0f,
+            linear(0, 2), linear(1, 2), linear(2, 2), 0.0f,
+            translation[0], translation[1], translation[2], 1.0f
+        };
+        glPushMatrix();
+        glMultMatrixf(transform);
+        mesh.draw(material);
+        glPopMatrix();
+    }
+};
@@ -6,8 +6,8 @@
 #include <cmath>
 
 struct RaySphereIntersection{
-    bool intersectionExists;
-    float t;
+    bool intersectionExists = false;
+    float t = FLT_MAX;
     Vec2 uv;
     Vec3 intersection;
     Vec3 secondintersection;
@@ -5,8 +5,8 @@
 #include <cmath>
 
 struct RaySquareIntersection{
-    bool intersectionExists;
-    float t;
+    bool intersectionExists = false;
+    float t = FLT_MAX;
     Vec2 uv;
     Vec3 intersection;
     Vec3 normal;
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <filesystem>
+#include <unistd.h>
+
+
+// Built trees saved on disk, named after a hash of everything their build reads: the same geometry with the same
+// build settings loads its tree back instead of building it again. Files are raw memory dumps, only meant to be
+// read by the same executable on the same machine (the hash covers the node layout, not the endianness).
+namespace accelerationCache{
+
+// empty disables the cache, and it's off by default: main opts in, tools and tests don't write files behind your back
+inline std::string directory;
+
+// below this a build is about as fast as reading the file back
+static const unsigned int MIN_PRIMITIVES = 10000;
+
+// bump when the file layout changes
+static const uint32_t FORMAT_VERSION = 1;
+static const char MAGIC[4] = {'I', 'M', 'A', 'C'};
+
+
+inline bool enabled(unsigned int n_primitives) {
+    return !directory.empty() && n_primitives >= MIN_PRIMITIVES;
+}
+
+
+// FNV-1a, 64 bits http://www.isthe.com/chongo/tech/comp/fnv/
+struct Hasher {
+    uint64_t value = 14695981039346656037ull;
+
+    void add(const void * data, size_t size) {
+        const unsigned char * bytes = static_cast< const unsigned char * >(data);
+        for (size_t i = 0; i < size; ++i){
+            value ^= bytes[i];
+            value *= 1099511628211ull;
+        }
+    }
+
+    template< class T >
+    void add(T v) { add(&v, sizeof(T)); } // by value, a static const member passed here needs no definition
+
+    void add(const char * s) { add(s, std::char_traits< char >::length(s)); }
+};
+
+
+inline std::string path(const char * kind, uint64_t key) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%016llx.bin", kind, (unsigned long long)key);
+    return directory + name;
+}
+
+
+// header, then each value or array in the order they're written. Arrays are their size followed by their bytes
+class Writer {
+    std::string final_path;
+    std::string tmp_path;
+    std::ofstream f;
+public:
+    Writer(const char * kind, uint64_t key) : final_path(path(kind, key)) {
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+
+        // scenes are built in parallel and two of them may write the same tree, maybe from two processes sharing the
+        // directory: every writer gets its own name (pid, then a count in this process), only a complete file gets the real one
+        static std::atomic< unsigned int > n_writers{0};
+        tmp_path = final_path + "." + std::to_string(getpid()) + "_" + std::to_string(n_writers++) + ".tmp";
+        f.open(tmp_path, std::ios::binary);
+
+        f.write(MAGIC, sizeof(MAGIC));
+        f.write(reinterpret_cast< const char * >(&FORMAT_VERSION), sizeof(FORMAT_VERSION));
+        f.write(reinterpret_cast< const char * >(&key), sizeof(key));
+    }
+
+    template< class T >
+    void write(const T & v) { f.write(reinterpret_cast< const char * >(&v), sizeof(T)); }
+
+    template< class T >
+    void write(const std::vector< T > & array) {
+        uint64_t n = array.size();
+        write(n);
+        f.write(reinterpret_cast< const char * >(array.data()), n * sizeof(T));
+    }
+
+    // false if anything went wrong, the cache is just skipped then
+    bool close() {
+        f.close();
+        std::error_code ec;
+        if (!f) {
+            std::filesystem::remove(tmp_path, ec);
+            return false;
+        }
+        std::filesystem::rename(tmp_path, final_path, ec);
+        return !ec;
+    }
+};
+
+
+class Reader {
+    std::ifstream f;
+    uintmax_t remaining = 0;
+    bool ok = false;
+public:
+    Reader(const char * kind, uint64_t key) {
+        std::string p = path(kind, key);
+        std::error_code ec;
+        remaining = std::filesystem::file_size(p, ec);
+        if (ec) return;
+        f.open(p, std::ios::binary);
+        if (!f) return;
+
+        char magic[4];
+        uint32_t version;
+        uint64_t file_key;
+        ok = true;
+        ok = read(magic) && read(version) && read(file_key)
+            && std::equal(magic, magic + 4, MAGIC) && version == FORMAT_VERSION && file_key == key;
+    }
+
+    bool good() const { return ok; }
+
+    template< class T >
+    bool read(T & v) {
+        if (!ok || remaining < sizeof(T)) return ok = false;
+        f.read(reinterpret_cast< char * >(&v), sizeof(T));
+        remaining -= sizeof(T);
+        return ok = bool(f);
+    }
+
+    template< class T >
+    bool read(std::vector< T > & array) {
+        uint64_t n;
+        if (!read(n) || remaining / sizeof(T) < n) return ok = false;
+        array.resize(n);
+        f.read(reinterpret_cast< char * >(array.data()), n * sizeof(T));
+        remaining -= n * sizeof(T);
+        return ok = bool(f);
+    }
+};
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <thread>
+#include <atomic>
+#include "src/mesh/Triangle.h"
+#include "src/utils/Ray.h"
+#include "RaySceneIntersection.h"
+#include "src/utils/Vec3.h"
+
+// common ground for the scene-wide structures (KDTree, BVH) so the Scene doesn't care which one it has
+
+enum AccelerationType {
+    AccelerationType_KdTree,
+    AccelerationType_BVH
+};
+
+
+static inline float triangle_center(const Triangle& t, int axis){
+    return (t[0][axis] + t[1][axis] + t[2][axis]) / 3.0f;
+}
+
+static inline void set_AABB(const Triangle& t, Vec3 & res1, Vec3 & res2){
+
+    res1 = t[0];
+    res2 = t[0];
+    for (const Vec3 & vertex: {t[1], t[2]}){
+        res1[0] = std::min(vertex[0], res1[0]); res1[1] = std::min(vertex[1], res1[1]); res1[2] = std::min(vertex[2], res1[2]);
+        res2[0] = std::max(vertex[0], res2[0]); res2[1] = std::max(vertex[1], res2[1]); res2[2] = std::max(vertex[2], res2[2]);
+    }
+}
+
+static inline float AABB_surface_area(const Vec3 & AABB_v1, const Vec3 & AABB_v2){
+    Vec3 d = AABB_v2 - AABB_v1;
+    return 2.0f * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+// the threads acceleration structure builds may start, besides the ones asking for the builds. Every scene is built
+// at the same time at startup: a thread per core for each build would be scenes x cores threads, they all draw
+// from this one budget instead
+namespace buildThreads{
+
+inline std::atomic< int > available{(int)std::max(1u, std::thread::hardware_concurrency()) - 1};
+
+// false if every core is already building something, the caller does the work itself then
+inline bool tryAcquire(){
+    int n = available.load();
+    while (n > 0){
+        if (available.compare_exchange_weak(n, n - 1)) return true;
+    }
+    return false;
+}
+
+// once the thread's work is done
+inline void release(){ available++; }
+
+}
+
+
+// binned SAH, see https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+// The best plane found by binnedSAHSplit: between bins `bin` and `bin + 1` of `axis`
+struct BinnedSplit {
+    float cost = FLT_MAX; // stays FLT_MAX if no plane separates the centers
+    int axis = 0;
+    int bin = 0;
+    int n_bins = 1;
+    Vec3 c_min = Vec3(FLT_MAX), c_max = Vec3(-FLT_MAX); // bins are laid on the bounds of the centers, not of the node
+
+    inline bool found() const { return cost < FLT_MAX; }
+
+    inline int binOf(float center, int a) const {
+        return std::min(n_bins - 1, (int)(n_bins * (center - c_min[a]) / (c_max[a] - c_min[a])));
+    }
+
+    // the plane itself, every center <= position is in a bin <= bin (give or take a rounding)
+    inline float position() const {
+        return c_min[axis] + (c_max[axis] - c_min[axis]) * (bin + 1) / n_bins;
+    }
+};
+
+// n primitives, center(i, a) is the one binned, prim(i) has the box (AABB_v1, AABB_v2).
+// With parallel_axes the y and z axes are binned by other threads if there are some free, only worth it for the
+// first levels of big builds
+template< int N_BINS, class Center, class Prim >
+BinnedSplit binnedSAHSplit(unsigned int n, const Center & center, const Prim & prim, float parent_area,
+                           float traversal_cost, float intersection_cost, bool parallel_axes){
+    struct Bin {Vec3 AABB_v1 = Vec3(FLT_MAX); Vec3 AABB_v2 = Vec3(-FLT_MAX); int count = 0;};
+
+    BinnedSplit split;
+    split.n_bins = N_BINS;
+    for (unsigned int i = 0; i < n; ++i){
+        for (int a = 0; a < 3; ++a){
+            float c = center(i, a);
+            split.c_min[a] = std::min(split.c_min[a], c);
+            split.c_max[a] = std::max(split.c_max[a], c);
+        }
+    }
+
+    // best bin on each axis, they're independent until we pick one
+    struct AxisSplit {float cost = FLT_MAX; int bin = 0;};
+    AxisSplit best[3];
+
+    auto evaluate_axis = [&](int a){
+        if (split.c_max[a] - split.c_min[a] <= 0.0f) return; // every center on the same plane, can't split on that axis
+
+        Bin bins[N_BINS];
+        for (unsigned int i = 0; i < n; ++i){
+            Bin & bin = bins[split.binOf(center(i, a), a)];
+            const auto & p = prim(i);
+            bin.count++;
+            for (int k = 0; k < 3; ++k){
+                bin.AABB_v1[k] = std::min(bin.AABB_v1[k], p.AABB_v1[k]);
+                bin.AABB_v2[k] = std::max(bin.AABB_v2[k], p.AABB_v2[k]);
+            }
+        }
+
+        // sweep from the right to get the area and count of every right side, then from the left
+        float right_area[N_BINS];
+        int right_count[N_BINS];
+        Bin acc;
+        for (int b = N_BINS - 1; b > 0; --b){
+            acc.count += bins[b].count;
+            for (int k = 0; k < 3; ++k){
+                acc.AABB_v1[k] = std::min(acc.AABB_v1[k], bins[b].AABB_v1[k]);
+                acc.AABB_v2[k] = std::max(acc.AABB_v2[k], bins[b].AABB_v2[k]);
+            }
+            right_area[b] = (acc.count > 0) ? AABB_surface_area(acc.AABB_v1, acc.AABB_v2) : 0.0f;
+            right_count[b] = acc.count;
+        }
+
+        acc = Bin();
+        for (int b = 0; b < N_BINS - 1; ++b){
+            acc.count += bins[b].count;
+            for (int k = 0; k < 3; ++k){
+                acc.AABB_v1[k] = std::min(acc.AABB_v1[k], bins[b].AABB_v1[k]);
+                acc.AABB_v2[k] = std::max(acc.AABB_v2[k], bins[b].AABB_v2[k]);
+            }
+            if (acc.count == 0 || right_count[b+1] == 0) continue;
+
+            float cost = traversal_cost + intersection_cost *
+                (AABB_surface_area(acc.AABB_v1, acc.AABB_v2) * acc.count + right_area[b+1] * right_count[b+1]) / parent_area;
+
+            if (cost < best[a].cost){
+                best[a].cost = cost;
+                best[a].bin = b;
+            }
+        }
+    };
+
+    std::thread helpers[3];
+    for (int a = 1; a < 3; ++a){
+        if (parallel_axes && buildThreads::tryAcquire()){
+            helpers[a] = std::thread([&evaluate_axis, a](){
+                evaluate_axis(a);
+                buildThreads::release();
+            });
+        }
+    }
+    for (int a = 0; a < 3; ++a){
+        if (!helpers[a].joinable()) evaluate_axis(a);
+    }
+    for (std::thread & t: helpers){
+        if (t.joinable()) t.join();
+    }
+
+    for (int a = 0; a < 3; ++a){
+        if (best[a].cost < split.cost){
+            split.cost = best[a].cost;
+            split.axis = a;
+            split.bin = best[a].bin;
+        }
+    }
+    return split;
+}
+
+// slab test, https://tavianator.com/2011/ray_box.html
+// clips [t_min, t_max] to the part of the ray inside the box. False if nothing is left,
+// so boxes behind the origin or past t_max (closest hit, light distance) are culled too
+static inline bool collide_AABB(const Vec3 & AABB_v1, const Vec3 & AABB_v2, const Ray & r, float t_min, float t_max, float & t_entry){
+
+    Vec3 aa1_to_r = AABB_v1 - r.origin();
+    Vec3 aa2_to_r = AABB_v2 - r.origin();
+
+    float tx1 = (aa1_to_r[0]) * r.invdir[0];
+    float tx2 = (aa2_to_r[0]) * r.invdir[0];
+
+    float tmin = std::max(t_min, std::min(tx1, tx2));
+    float tmax = std::min(t_max, std::max(tx1, tx2));
+
+    float ty1 = (aa1_to_r[1]) * r.invdir[1];
+    float ty2 = (aa2_to_r[1]) * r.invdir[1];
+
+    tmin = std::max(tmin, std::min(ty1, ty2));
+    tmax = std::min(tmax, std::max(ty1, ty2));
+
+    float tz1 = (aa1_to_r[2]) * r.invdir[2];
+    float tz2 = (aa2_to_r[2]) * r.invdir[2];
+
+    tmin = std::max(tmin, std::min(tz1, tz2));
+    tmax = std::min(tmax, std::max(tz1, tz2));
+
+    t_entry = tmin;
+    return tmax >= tmin;
+}
+
+// a depth first walk holds at most one pending sibling per level, plus the two children of the current node,
+// so a tree capped at depth D never needs more than D+1 entries
+template< int CAPACITY >
+struct TraversalStack {
+    unsigned int data[CAPACITY];
+    int size = 0;
+
+    inline void push(unsigned int node_idx) { data[size++] = node_idx; }
+    inline unsigned int pop() { return data[--size]; }
+    inline bool empty() const { return size == 0; }
+};
+
+
+// camera rays are traced by packets of 4x4 neighbouring pixels, they start at the same point and go almost the same way
+static const int PACKET_SIZE = 16;
+
+
+class AccelerationStructure {
+public:
+    virtual ~AccelerationStructure() = default;
+
+    // closest hit at t >= MIN_OFFSET_VALUE, with the same fields the Scene would fill itself
+    virtual RaySceneIntersection getIntersection(const Ray & r) const = 0;
+
+    // getIntersection for n <= PACKET_SIZE rays at once. One by one unless the structure knows better
+    virtual void getIntersections(const Ray * rays, int n, RaySceneIntersection * results) const {
+        for (int i = 0; i < n; ++i) results[i] = getIntersection(rays[i]);
+    }
+
+    // any hit in ]MIN_OFFSET_VALUE, max_t[ with something that casts shadows
+    virtual bool hasIntersection(const Ray & r, float max_t) const = 0;
+
+    // false if the Scene still has to test its spheres, squares and instances itself
+    virtual bool coversWholeScene() const = 0;
+
+    virtual const char * name() const = 0;
+};
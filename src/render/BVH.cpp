@@ -0,0 +1,643 @@
+#include "BVH.h"
+
+#include <algorithm>
+
+
+BVH::BVH(const std::vector< Mesh >& meshes,
+    const std::vector< Sphere >& scene_spheres,
+    const std::vector< Square >& scene_squares,
+    const std::vector< Mesh >& prototypes,
+    const std::vector< MeshInstance >& scene_instances,
+    const std::vector< std::shared_ptr< Material > >& materials){
+
+    std::vector< PrimInfo > infos;
+
+    Vec3 AABB_v1;
+    Vec3 AABB_v2;
+
+    for (unsigned int i = 0; i < meshes.size(); ++i){
+        addTriangles(meshes[i], i, infos);
+    }
+
+    for (unsigned int i = 0; i < scene_spheres.size(); ++i){
+        const Sphere & sphere = scene_spheres[i];
+        Vec3 r(sphere.m_radius);
+
+        infos.push_back({sphere.m_center - r, sphere.m_center + r, sphere.m_center, {INTERSECTION_SPHERE, (unsigned int)spheres.size()}});
+        spheres.push_back({&sphere, i, materials[sphere.material_id]->casts_shadows});
+    }
+
+    for (unsigned int i = 0; i < scene_squares.size(); ++i){
+        const Square & square = scene_squares[i];
+
+        AABB_v1 = Vec3(FLT_MAX);
+        AABB_v2 = Vec3(-FLT_MAX);
+        for (const MeshVertex & v: square.vertices){
+            for (int k = 0; k < 3; ++k){
+                AABB_v1[k] = std::min(AABB_v1[k], v.position[k]);
+                AABB_v2[k] = std::max(AABB_v2[k], v.position[k]);
+            }
+        }
+        // squares are flat, keep some thickness so the slab test doesn't end up dividing 0 by 0
+        AABB_v1 -= Vec3(0.0001, 0.0001, 0.0001);
+        AABB_v2 += Vec3(0.0001, 0.0001, 0.0001);
+
+        infos.push_back({AABB_v1, AABB_v2, (AABB_v1 + AABB_v2) / 2.0f, {INTERSECTION_SQUARE, (unsigned int)squares.size()}});
+        squares.push_back({&square, i, materials[square.material_id]->casts_shadows});
+    }
+
+    // bottom level first, the instances' boxes come from their prototype's root
+    blas.reserve(prototypes.size());
+    for (const Mesh & prototype: prototypes){
+        blas.emplace_back(prototype);
+    }
+
+    for (unsigned int i = 0; i < scene_instances.size(); ++i){
+        const MeshInstance & instance = scene_instances[i];
+        const BVH & bottom = blas[instance.prototype];
+        if (bottom.wide_nodes.empty()) continue;
+
+        instance.transformAABB(bottom.root_AABB_v1, bottom.root_AABB_v2, AABB_v1, AABB_v2);
+
+        infos.push_back({AABB_v1, AABB_v2, (AABB_v1 + AABB_v2) / 2.0f, {INTERSECTION_INSTANCE, (unsigned int)instances.size()}});
+        instances.push_back({&instance, i});
+    }
+
+    finalize(infos);
+}
+
+
+BVH::BVH(const Mesh & mesh){
+    std::vector< PrimInfo > infos;
+    addTriangles(mesh, 0, infos);
+    finalize(infos);
+}
+
+
+void BVH::addTriangles(const Mesh & mesh, int meshIndex, std::vector< PrimInfo > & infos){
+    Vec3 AABB_v1;
+    Vec3 AABB_v2;
+
+    for (const MeshTriangle & tri: mesh.triangles){
+        Triangle t(
+            mesh.vertices[ tri.v[0] ].position,
+            mesh.vertices[ tri.v[1] ].position,
+            mesh.vertices[ tri.v[2] ].position
+        );
+
+        set_AABB(t, AABB_v1, AABB_v2);
+
+        infos.push_back({AABB_v1, AABB_v2, (AABB_v1 + AABB_v2) / 2.0f, {INTERSECTION_MESH, (unsigned int)tris.size()}});
+        tris.push_back({t, mesh.cull_backfaces, meshIndex});
+    }
+}
+
+
+void BVH::finalize(std::vector< PrimInfo > & infos){
+    if (infos.empty()) return;
+
+    bool use_cache = accelerationCache::enabled(infos.size());
+    uint64_t key = use_cache ? cacheKey(infos) : 0;
+
+    std::vector< PrimRef > leaf_order;
+    if (!use_cache || !loadCache(key, leaf_order)){
+        nodes.reserve(2 * infos.size() / MAX_PRIMS_PER_LEAF + 1);
+        build(infos, 0, infos.size(), 0, nodes, max_depth);
+
+        leaf_order.reserve(infos.size());
+        for (const PrimInfo & info: infos) leaf_order.push_back(info.ref);
+
+        if (use_cache) saveCache(key, leaf_order);
+    }
+
+    // put the triangles in leaf order, so a leaf's triangles are contiguous in tris too
+    std::vector< BVHTriangle > ordered;
+    ordered.reserve(tris.size());
+    prims.reserve(leaf_order.size());
+    for (PrimRef ref: leaf_order){
+        if (ref.type == INTERSECTION_MESH){
+            ordered.push_back(tris[ref.index]);
+            ref.index = ordered.size() - 1;
+        }
+        prims.push_back(ref);
+    }
+    tris = std::move(ordered);
+
+    records.reserve(tris.size());
+    for (const BVHTriangle & tri: tris) records.push_back(tri.triangle, tri.cull_backface);
+
+    root_AABB_v1 = nodes[0].AABB_v1;
+    root_AABB_v2 = nodes[0].AABB_v2;
+    wide_nodes.reserve(nodes.size() / 3 + 1);
+    collapse(0);
+    nodes.clear();
+    nodes.shrink_to_fit();
+}
+
+
+unsigned int BVH::collapse(unsigned int binary_idx){
+    unsigned int idx = wide_nodes.size();
+    wide_nodes.emplace_back();
+
+    unsigned int children[4];
+    int n_children = 1;
+    children[0] = binary_idx;
+
+    // open the biggest interior child until there are 4 of them, so the boxes that are the most likely to be hit
+    // get tested together. A root leaf stays alone in its wide node
+    while (n_children < 4){
+        int opened = -1;
+        float opened_area = -1.0f;
+        for (int i = 0; i < n_children; ++i){
+            const Node & n = nodes[children[i]];
+            if (n.is_leaf()) continue;
+            float area = AABB_surface_area(n.AABB_v1, n.AABB_v2);
+            if (area > opened_area){
+                opened = i;
+                opened_area = area;
+            }
+        }
+        if (opened < 0) break;
+
+        unsigned int interior = children[opened];
+        children[opened] = interior + 1;
+        children[n_children++] = nodes[interior].offset;
+    }
+
+    WideNode wide;
+    for (int i = 0; i < n_children; ++i){
+        const Node & n = nodes[children[i]];
+        for (int k = 0; k < 3; ++k){
+            wide.AABB_v1[k][i] = n.AABB_v1[k];
+            wide.AABB_v2[k][i] = n.AABB_v2[k];
+        }
+        if (n.is_leaf()){
+            wide.child[i] = n.offset;
+            wide.n_prims[i] = n.n_prims;
+        } else {
+            wide.child[i] = collapse(children[i]);
+        }
+    }
+    wide_nodes[idx] = wide; // no reference kept on wide_nodes[idx], the vector grew in between
+    return idx;
+}
+
+
+BVH::WideNode::WideNode(){
+    for (int i = 0; i < 4; ++i){
+        for (int k = 0; k < 3; ++k){
+            AABB_v1[k][i] = FLT_MAX;
+            AABB_v2[k][i] = -FLT_MAX;
+        }
+        child[i] = 0;
+        n_prims[i] = 0;
+    }
+}
+
+
+// slab test against the 4 boxes at once. Taking the near plane from the sign of the direction instead of a min/max
+// is what keeps the empty slots empty
+inline int BVH::WideNode::collideChildren(const Ray & r, float t_min, float t_max, float t_entry[4]) const {
+#if defined(__SSE2__)
+    __m128 t_near = _mm_set1_ps(t_min);
+    __m128 t_far = _mm_set1_ps(t_max);
+    for (int k = 0; k < 3; ++k){
+        bool positive = r.invdir[k] >= 0.0f;
+        __m128 origin = _mm_set1_ps(r.origin()[k]);
+        __m128 invdir = _mm_set1_ps(r.invdir[k]);
+        __m128 near_plane = _mm_load_ps(positive ? AABB_v1[k] : AABB_v2[k]);
+        __m128 far_plane = _mm_load_ps(positive ? AABB_v2[k] : AABB_v1[k]);
+        t_near = _mm_max_ps(t_near, _mm_mul_ps(_mm_sub_ps(near_plane, origin), invdir));
+        t_far = _mm_min_ps(t_far, _mm_mul_ps(_mm_sub_ps(far_plane, origin), invdir));
+    }
+    _mm_storeu_ps(t_entry, t_near);
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+    int hits = 0;
+    for (int i = 0; i < 4; ++i){
+        float t_near = t_min;
+        float t_far = t_max;
+        for (int k = 0; k < 3; ++k){
+            bool positive = r.invdir[k] >= 0.0f;
+            t_near = std::max(t_near, ((positive ? AABB_v1[k][i] : AABB_v2[k][i]) - r.origin()[k]) * r.invdir[k]);
+            t_far = std::min(t_far, ((positive ? AABB_v2[k][i] : AABB_v1[k][i]) - r.origin()[k]) * r.invdir[k]);
+        }
+        t_entry[i] = t_near;
+        if (t_near <= t_far) hits |= 1 << i;
+    }
+    return hits;
+#endif
+}
+
+
+uint64_t BVH::cacheKey(const std::vector< PrimInfo > & infos) const {
+    accelerationCache::Hasher h;
+    h.add("bvh");
+    h.add(sizeof(Node));
+    h.add(MAX_DEPTH); h.add(MAX_PRIMS_PER_LEAF);
+    h.add(SAH_N_BINS); h.add(SAH_TRAVERSAL_COST); h.add(SAH_INTERSECTION_COST);
+    h.add(infos.data(), infos.size() * sizeof(PrimInfo));
+    return h.value;
+}
+
+
+bool BVH::loadCache(uint64_t key, std::vector< PrimRef > & leaf_order){
+    accelerationCache::Reader f("bvh", key);
+    bool ok = f.read(max_depth) && max_depth < MAX_DEPTH && f.read(nodes) && f.read(leaf_order);
+
+    // the key matched, but don't trust the file further than what the traversal indexes
+    for (unsigned int i = 0; ok && i < nodes.size(); ++i){
+        ok = nodes[i].is_leaf() ? (uint64_t)nodes[i].offset + nodes[i].n_prims <= leaf_order.size() : nodes[i].offset < nodes.size();
+    }
+    for (unsigned int i = 0; ok && i < leaf_order.size(); ++i){
+        const PrimRef & ref = leaf_order[i];
+        switch (ref.type){
+            case INTERSECTION_MESH: ok = ref.index < tris.size(); break;
+            case INTERSECTION_SPHERE: ok = ref.index < spheres.size(); break;
+            case INTERSECTION_SQUARE: ok = ref.index < squares.size(); break;
+            case INTERSECTION_INSTANCE: ok = ref.index < instances.size(); break;
+        }
+    }
+
+    if (!ok){
+        nodes.clear();
+        leaf_order.clear();
+        max_depth = 0;
+    }
+    return ok;
+}
+
+
+void BVH::saveCache(uint64_t key, const std::vector< PrimRef > & leaf_order) const {
+    accelerationCache::Writer f("bvh", key);
+    f.write(max_depth);
+    f.write(nodes);
+    f.write(leaf_order);
+    f.close();
+}
+
+
+unsigned int BVH::build(std::vector< PrimInfo > & infos, unsigned int begin, unsigned int end, int depth,
+    std::vector< Node > & out, int & out_max_depth) const {
+    unsigned int idx = out.size();
+    out.emplace_back();
+    out_max_depth = std::max(out_max_depth, depth);
+
+    Node node;
+    for (unsigned int i = begin; i < end; ++i){
+        for (int k = 0; k < 3; ++k){
+            node.AABB_v1[k] = std::min(node.AABB_v1[k], infos[i].AABB_v1[k]);
+            node.AABB_v2[k] = std::max(node.AABB_v2[k], infos[i].AABB_v2[k]);
+        }
+    }
+
+    int axis = 0;
+    unsigned int mid;
+    if (depth >= MAX_DEPTH - 1 || !partitionSAH(infos, begin, end, node, axis, mid)){
+        // triangles first in the leaf
+        std::stable_partition(infos.begin() + begin, infos.begin() + end,
+            [](const PrimInfo & info){ return info.ref.type == INTERSECTION_MESH; }
+        );
+        node.offset = begin;
+        node.n_prims = end - begin;
+        out[idx] = node;
+        return idx;
+    }
+
+    node.axis = axis;
+    out[idx] = node;
+
+    if (end - mid >= PARALLEL_MIN_PRIMS && buildThreads::tryAcquire()){
+        // the two sides are disjoint ranges of infos, the second one is built next to us in its own array
+        std::vector< Node > second_nodes;
+        int second_max_depth = 0;
+        std::thread worker([&](){
+            build(infos, mid, end, depth + 1, second_nodes, second_max_depth);
+            buildThreads::release();
+        });
+        build(infos, begin, mid, depth + 1, out, out_max_depth); // lands on idx+1
+        worker.join();
+
+        // its interior nodes point inside second_nodes, shift them to where it lands. Leaves point in infos, they don't move
+        unsigned int second = out.size();
+        for (Node & n: second_nodes){
+            if (!n.is_leaf()) n.offset += second;
+            out.push_back(n);
+        }
+        out[idx].offset = second;
+        out_max_depth = std::max(out_max_depth, second_max_depth);
+        return idx;
+    }
+
+    build(infos, begin, mid, depth + 1, out, out_max_depth); // lands on idx+1
+    unsigned int second = build(infos, mid, end, depth + 1, out, out_max_depth);
+    out[idx].offset = second; // no reference kept on out[idx], the vector grew in between
+    return idx;
+}
+
+
+bool BVH::partitionSAH(std::vector< PrimInfo > & infos, unsigned int begin, unsigned int end, const Node & node, int & axis, unsigned int & mid) const {
+    unsigned int n = end - begin;
+    if (n <= 1) return false;
+
+    BinnedSplit split = binnedSAHSplit< SAH_N_BINS >(n,
+        [&](unsigned int i, int a){ return infos[begin + i].center[a]; },
+        [&](unsigned int i) -> const PrimInfo & { return infos[begin + i]; },
+        AABB_surface_area(node.AABB_v1, node.AABB_v2), SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, n >= PARALLEL_BINNING_MIN_PRIMS
+    );
+
+    if (!split.found()){
+        // every center in the same spot, no plane can separate them. Cut the range in two anyway if it's too big for a leaf
+        if (n <= MAX_PRIMS_PER_LEAF) return false;
+        mid = begin + n / 2;
+        return true;
+    }
+
+    float leaf_cost = SAH_INTERSECTION_COST * n;
+    if (split.cost >= leaf_cost && n <= MAX_PRIMS_PER_LEAF) return false;
+
+    // same binning as the split's so both sides match the counts the cost was computed with, and none is empty
+    axis = split.axis;
+    mid = std::partition(infos.begin() + begin, infos.begin() + end,
+        [&](const PrimInfo & p){ return split.binOf(p.center[axis], axis) <= split.bin; }
+    ) - infos.begin();
+    return true;
+}
+
+
+inline unsigned int BVH::leafTriangles(unsigned int offset, unsigned int n_prims) const {
+    unsigned int n = 0;
+    while (n < n_prims && prims[offset + n].type == INTERSECTION_MESH) ++n;
+    return n;
+}
+
+
+inline bool BVH::intersectPrimitive(const PrimRef & ref, const Ray & r, RaySceneIntersection & result) const {
+    switch (ref.type){
+        case INTERSECTION_SPHERE: {
+            const BVHSphere & sphere = spheres[ref.index];
+            RaySphereIntersection candidate = sphere.sphere->intersect(r);
+            if (!candidate.intersectionExists || candidate.t >= result.t || candidate.t < MIN_OFFSET_VALUE) return false;
+
+            result.raySphereIntersection = candidate;
+            result.objectIndex = sphere.sceneIndex;
+            result.t = candidate.t;
+            break;
+        }
+        case INTERSECTION_SQUARE: {
+            const BVHSquare & square = squares[ref.index];
+            RaySquareIntersection candidate = square.square->intersect(r);
+            if (!candidate.intersectionExists || candidate.t >= result.t || candidate.t < MIN_OFFSET_VALUE) return false;
+
+            result.raySquareIntersection = candidate;
+            result.objectIndex = square.sceneIndex;
+            result.t = candidate.t;
+            break;
+        }
+        case INTERSECTION_INSTANCE: {
+            const BVHInstance & instance = instances[ref.index];
+            float t_scale;
+            Ray local = instance.instance->toObjectSpace(r, t_scale);
+
+            RaySceneIntersection candidate;
+            candidate.t = result.t * t_scale; // only look for something closer than what we have
+            blas[instance.instance->prototype].traverseClosest(local, candidate);
+            if (!candidate.intersectionExists) return false;
+
+            instance.instance->toWorldSpace(candidate.rayMeshIntersection, r, t_scale);
+            if (candidate.rayMeshIntersection.t >= result.t || candidate.rayMeshIntersection.t < MIN_OFFSET_VALUE) return false;
+
+            result.rayMeshIntersection = candidate.rayMeshIntersection;
+            result.objectIndex = instance.sceneIndex;
+            result.t = candidate.rayMeshIntersection.t;
+            break;
+        }
+        default:
+            return false;
+    }
+    result.intersectionExists = true;
+    result.typeOfIntersectedObject = ref.type;
+    return true;
+}
+
+// same rules as Scene::computeOcclusion. Triangles aren't tested here, the leaves take them a whole run at a time
+inline bool BVH::occludes(const PrimRef & ref, const Ray & r, float max_t) const {
+    switch (ref.type){
+        case INTERSECTION_SPHERE: {
+            const BVHSphere & sphere = spheres[ref.index];
+            if (!sphere.casts_shadows) return false;
+            RaySphereIntersection candidate = sphere.sphere->intersect(r);
+            return candidate.intersectionExists && candidate.t >= MIN_OFFSET_VALUE*10.0 && candidate.t < max_t;
+        }
+        case INTERSECTION_SQUARE: {
+            const BVHSquare & square = squares[ref.index];
+            if (!square.casts_shadows) return false;
+            RaySquareIntersection candidate = square.square->intersect(r);
+            return candidate.intersectionExists && candidate.t >= MIN_OFFSET_VALUE && candidate.t < max_t;
+        }
+        case INTERSECTION_INSTANCE: {
+            const MeshInstance & instance = *instances[ref.index].instance;
+            float t_scale;
+            Ray local = instance.toObjectSpace(r, t_scale);
+            return blas[instance.prototype].hasIntersection(local, max_t * t_scale);
+        }
+        default:
+            return false;
+    }
+}
+
+
+inline bool BVH::occludesLeaf(unsigned int offset, unsigned int n_prims, const Ray & r, float max_t) const {
+    unsigned int n_tris = leafTriangles(offset, n_prims);
+    if (n_tris > 0){
+        unsigned int first_tri = prims[offset].index;
+        if (records.anyHit(first_tri, first_tri + n_tris, r, MIN_OFFSET_VALUE, max_t)) return true;
+    }
+    for (unsigned int i = offset + n_tris; i < offset + n_prims; ++i){
+        if (occludes(prims[i], r, max_t)) return true;
+    }
+    return false;
+}
+
+
+bool BVH::hasIntersection(const Ray & r, float max_t) const{
+    if (wide_nodes.empty()) return false;
+
+    WideTraversalStack to_process;
+    to_process.push(0);
+    while (! to_process.empty()){
+        const WideNode & current = wide_nodes[to_process.pop()];
+
+        alignas(16) float t_entry[4];
+        int hits = current.collideChildren(r, MIN_OFFSET_VALUE, max_t, t_entry);
+
+        for (int i = 0; i < 4; ++i){
+            if (!(hits >> i & 1)) continue;
+            if (current.n_prims[i] > 0){
+                if (occludesLeaf(current.child[i], current.n_prims[i], r, max_t)) return true;
+            } else {
+                to_process.push(current.child[i]);
+            }
+        }
+    }
+    return false;
+}
+
+
+RaySceneIntersection BVH::getIntersection(const Ray & r) const{
+    RaySceneIntersection result;
+    traverseClosest(r, result);
+    return result;
+}
+
+
+inline void BVH::intersectLeaf(unsigned int offset, unsigned int n_prims, const Ray & r, RaySceneIntersection & result) const {
+    unsigned int n_tris = leafTriangles(offset, n_prims);
+    if (n_tris > 0){
+        unsigned int first_tri = prims[offset].index;
+        int hit = records.closestHit(first_tri, first_tri + n_tris, r, MIN_OFFSET_VALUE, result.t);
+        if (hit >= 0){
+            result.intersectionExists = true;
+            result.typeOfIntersectedObject = INTERSECTION_MESH;
+            result.rayMeshIntersection = records.hit(hit, r, result.t);
+            result.objectIndex = tris[hit].meshIndex;
+        }
+    }
+    for (unsigned int i = offset + n_tris; i < offset + n_prims; ++i){
+        intersectPrimitive(prims[i], r, result);
+    }
+}
+
+
+void BVH::traverseClosest(const Ray & r, RaySceneIntersection & result) const{
+    if (wide_nodes.empty()) return;
+
+    WideTraversalStack to_process;
+    to_process.push(0);
+
+    while (! to_process.empty()){
+        const WideNode & current = wide_nodes[to_process.pop()];
+
+        alignas(16) float t_entry[4];
+        int hits = current.collideChildren(r, 0.0f, result.t, t_entry);
+
+        // leaves are tested right away, they can only bring result.t closer for their siblings.
+        // Interior children are sorted far to near, so the near one is popped first
+        unsigned int pending[4];
+        float pending_t[4];
+        int n_pending = 0;
+        for (int i = 0; i < 4; ++i){
+            if (!(hits >> i & 1)) continue;
+            if (current.n_prims[i] > 0){
+                intersectLeaf(current.child[i], current.n_prims[i], r, result);
+                continue;
+            }
+            int j = n_pending++;
+            while (j > 0 && pending_t[j-1] < t_entry[i]){
+                pending[j] = pending[j-1];
+                pending_t[j] = pending_t[j-1];
+                --j;
+            }
+            pending[j] = current.child[i];
+            pending_t[j] = t_entry[i];
+        }
+        for (int j = 0; j < n_pending; ++j){
+            if (pending_t[j] <= result.t) to_process.push(pending[j]);
+        }
+    }
+}
+
+
+inline unsigned int BVH::collidePacket(const WideNode & node, int child, const PacketLanes & lanes, unsigned int mask, float & t_entry) const {
+    using namespace simd;
+    const unsigned int lane_bits = (1u << WIDTH) - 1;
+
+    alignas(32) float entries[PACKET_SIZE];
+    unsigned int hits = 0;
+    for (int first = 0; first < PACKET_SIZE; first += WIDTH){
+        if (!(mask >> first & lane_bits)) continue;
+
+        Float t_near(0.0f);
+        Float t_far = Float::load(&lanes.t_max[first]);
+        const float * origins[3] = {lanes.ox, lanes.oy, lanes.oz};
+        const float * invdirs[3] = {lanes.ix, lanes.iy, lanes.iz};
+        for (int k = 0; k < 3; ++k){
+            Float o = Float::load(&origins[k][first]);
+            Float inv = Float::load(&invdirs[k][first]);
+            Float t1 = (Float(node.AABB_v1[k][child]) - o) * inv;
+            Float t2 = (Float(node.AABB_v2[k][child]) - o) * inv;
+            // near plane from the direction's sign and not a min, or the empty slots' inverted boxes would be infinite ones
+            Mask positive = inv >= Float(0.0f);
+            t_near = max(t_near, select(positive, t1, t2));
+            t_far = min(t_far, select(positive, t2, t1));
+        }
+        hits |= (unsigned int)bits(t_near <= t_far) << first;
+        t_near.store(&entries[first]);
+    }
+    hits &= mask;
+
+    t_entry = FLT_MAX;
+    for (unsigned int m = hits; m; m &= m - 1){
+        t_entry = std::min(t_entry, entries[__builtin_ctz(m)]);
+    }
+    return hits;
+}
+
+
+void BVH::getIntersections(const Ray * rays, int n, RaySceneIntersection * results) const{
+    for (int i = 0; i < n; ++i) results[i] = RaySceneIntersection();
+    if (wide_nodes.empty() || n == 0) return;
+
+    PacketLanes lanes;
+    for (int i = 0; i < PACKET_SIZE; ++i){
+        const Ray & r = rays[std::min(i, n - 1)]; // unused lanes copy the last ray, they're masked out anyway
+        lanes.ox[i] = r.origin()[0]; lanes.oy[i] = r.origin()[1]; lanes.oz[i] = r.origin()[2];
+        lanes.ix[i] = r.invdir[0]; lanes.iy[i] = r.invdir[1]; lanes.iz[i] = r.invdir[2];
+        lanes.t_max[i] = FLT_MAX;
+    }
+
+    // each node goes with the rays that reached its parent, the others can't reach it either
+    WideTraversalStack to_process;
+    unsigned int masks[3 * MAX_DEPTH + 4];
+    to_process.push(0);
+    masks[0] = (1u << n) - 1;
+
+    while (! to_process.empty()){
+        unsigned int mask = masks[to_process.size - 1];
+        const WideNode & current = wide_nodes[to_process.pop()];
+
+        unsigned int pending[4];
+        unsigned int pending_mask[4];
+        float pending_t[4];
+        int n_pending = 0;
+        for (int c = 0; c < 4; ++c){
+            float t_entry;
+            unsigned int hits = collidePacket(current, c, lanes, mask, t_entry);
+            if (!hits) continue;
+
+            if (current.n_prims[c] > 0){
+                for (unsigned int m = hits; m; m &= m - 1){
+                    int i = __builtin_ctz(m);
+                    intersectLeaf(current.child[c], current.n_prims[c], rays[i], results[i]);
+                    lanes.t_max[i] = results[i].t;
+                }
+                continue;
+            }
+            // far to near, like traverseClosest
+            int j = n_pending++;
+            while (j > 0 && pending_t[j-1] < t_entry){
+                pending[j] = pending[j-1];
+                pending_mask[j] = pending_mask[j-1];
+                pending_t[j] = pending_t[j-1];
+                --j;
+            }
+            pending[j] = current.child[c];
+            pending_mask[j] = hits;
+            pending_t[j] = t_entry;
+        }
+        for (int j = 0; j < n_pending; ++j){
+            masks[to_process.size] = pending_mask[j];
+            to_process.push(pending[j]);
+        }
+    }
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include "src/mesh/Mesh.h"
+#include "src/mesh/Triangle.h"
+#include "src/mesh/Sphere.h"
+#include "src/mesh/Square.h"
+#include "src/mesh/MeshInstance.h"
+#include "src/render/Material.h"
+#include "AccelerationStructure.h"
+#include "AccelerationCache.h"
+#include "TriangleRecords.h"
+#include "src/utils/Simd.h"
+
+// Bounding volume hierarchy over everything in the scene: mesh triangles, spheres, squares and instances are all leaf entries.
+// Unlike the KDTree it's built straight into the flat node array (no intermediate tree), by partitioning
+// the primitives in place.
+// Two levels: every prototype gets its own BVH over its object space triangles (blas), the scene-wide one only
+// stores the instances' transforms and hands them the ray once it's brought in object space.
+// Once built, the binary tree is collapsed into a 4-wide one (QBVH), that's what the traversal reads.
+// Spheres, squares and instances are referenced, not copied: build it once every object is in its final place in the scene.
+class BVH: public AccelerationStructure{
+protected:
+    struct BVHTriangle {Triangle triangle; bool cull_backface = true; int meshIndex;};
+    struct BVHSphere {const Sphere * sphere; unsigned int sceneIndex; bool casts_shadows;};
+    struct BVHSquare {const Square * square; unsigned int sceneIndex; bool casts_shadows;};
+    struct BVHInstance {const MeshInstance * instance; unsigned int sceneIndex;};
+
+    // what a leaf actually lists. type is an INTERSECTION_TYPE, index points in tris, spheres, squares or instances
+    struct PrimRef {
+        unsigned int type : 2;
+        unsigned int index : 30;
+    };
+
+    // same layout as the KDTree nodes: first child is the next node, 32 bytes
+    struct Node {
+        Vec3 AABB_v1 = Vec3(FLT_MAX);
+        Vec3 AABB_v2 = Vec3(-FLT_MAX);
+        unsigned int offset = 0;        // leaf: first entry in prims. interior: index of the second child
+        unsigned int n_prims : 30;      // 0 for interior nodes
+        unsigned int axis : 2;
+
+        Node() : n_prims(0), axis(0) {}
+
+        inline bool is_leaf() const { return n_prims > 0; }
+        inline bool collideAABB(const Ray & r, float t_min, float t_max, float & t_entry) const {
+            return collide_AABB(AABB_v1, AABB_v2, r, t_min, t_max, t_entry);
+        }
+    };
+    static_assert(sizeof(Node) == 32, "Node should fit twice in a cache line");
+
+    // what the traversal reads: up to 4 children per node, their boxes side by side so a single SSE slab test
+    // checks all of them. Unused slots have an empty box (v1 = +inf, v2 = -inf) and are never hit
+    struct alignas(64) WideNode {
+        float AABB_v1[3][4]; // [axis][child]
+        float AABB_v2[3][4];
+        unsigned int child[4];      // interior child: index in wide_nodes. leaf child: first entry in prims
+        unsigned int n_prims[4];    // 0 for interior children
+
+        WideNode();
+
+        // bit i set if child i's box is crossed within [t_min, t_max], t_entry[i] is where it's entered
+        inline int collideChildren(const Ray & r, float t_min, float t_max, float t_entry[4]) const;
+    };
+    static_assert(sizeof(WideNode) == 128, "WideNode should be two cache lines");
+
+    // build time only
+    struct PrimInfo {Vec3 AABB_v1; Vec3 AABB_v2; Vec3 center; PrimRef ref;};
+    static_assert(sizeof(PrimInfo) == 40, "PrimInfo is hashed as raw bytes, it can't have padding");
+
+    static const int SAH_N_BINS = 12;
+    static constexpr float SAH_TRAVERSAL_COST = 1.0f;
+    static constexpr float SAH_INTERSECTION_COST = 1.0f;
+    static const int MAX_PRIMS_PER_LEAF = 8;
+
+    static const int MAX_DEPTH = 64;
+    // collapsing never makes the tree deeper, and each level leaves at most 3 siblings pending
+    using WideTraversalStack = TraversalStack< 3 * MAX_DEPTH + 4 >;
+
+    // same thresholds as the KDTree: subtree size worth a thread, and node size worth binning the axes in parallel
+    static const int PARALLEL_MIN_PRIMS = 4096;
+    static const int PARALLEL_BINNING_MIN_PRIMS = 65536;
+
+public:
+    std::vector< BVHTriangle > tris; // in leaf order, and first in their leaf
+    TriangleRecords records; // what the leaves test, same order as tris
+    std::vector< BVHSphere > spheres;
+    std::vector< BVHSquare > squares;
+    std::vector< BVHInstance > instances;
+
+    std::vector< BVH > blas; // one per prototype, in object space
+
+    std::vector< PrimRef > prims; // every leaf is a contiguous range
+    std::vector< Node > nodes; // output of the build (and what's cached), emptied once collapsed in wide_nodes
+    std::vector< WideNode > wide_nodes;
+
+    Vec3 root_AABB_v1 = Vec3(FLT_MAX); // box of the whole tree, for the instances of a bottom level
+    Vec3 root_AABB_v2 = Vec3(-FLT_MAX);
+
+    int max_depth = 0;
+
+    BVH() = default;
+
+    BVH(const std::vector< Mesh >& meshes,
+        const std::vector< Sphere >& scene_spheres,
+        const std::vector< Square >& scene_squares,
+        const std::vector< Mesh >& prototypes,
+        const std::vector< MeshInstance >& scene_instances,
+        const std::vector< std::shared_ptr< Material > >& materials);
+
+    // bottom level, a single mesh
+    explicit BVH(const Mesh & mesh);
+
+    RaySceneIntersection getIntersection(const Ray & r) const override;
+
+    // walks the tree once for the whole packet: each node is fetched once and its boxes tested against
+    // simd::WIDTH rays at a time, leaves are then tested by the rays that reached them
+    void getIntersections(const Ray * rays, int n, RaySceneIntersection * results) const override;
+
+    bool hasIntersection(const Ray & r, float max_t) const override;
+
+    bool coversWholeScene() const override { return true; }
+
+    const char * name() const override { return "Scene-wide BVH"; }
+
+private:
+    void addTriangles(const Mesh & mesh, int meshIndex, std::vector< PrimInfo > & infos);
+
+    // builds the tree over infos and puts tris in leaf order
+    void finalize(std::vector< PrimInfo > & infos);
+
+    // the build only reads infos, so their bytes and the settings are all the key needs
+    uint64_t cacheKey(const std::vector< PrimInfo > & infos) const;
+    // false if there is no usable file. Otherwise fills nodes, and leaf_order with the refs as the build would have sorted them
+    bool loadCache(uint64_t key, std::vector< PrimRef > & leaf_order);
+    void saveCache(uint64_t key, const std::vector< PrimRef > & leaf_order) const;
+
+    // the packet's rays, one array per coordinate
+    struct alignas(32) PacketLanes {
+        float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+        float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE];
+        float t_max[PACKET_SIZE]; // closest hit so far
+    };
+
+    // bit i set if ray i of the mask crosses child's box before its closest hit, t_entry is the closest entry among them
+    inline unsigned int collidePacket(const WideNode & node, int child, const PacketLanes & lanes, unsigned int mask, float & t_entry) const;
+
+    // closest hit closer than result.t, result is only updated if one is found
+    void traverseClosest(const Ray & r, RaySceneIntersection & result) const;
+
+    // builds the subtree of infos[begin, end[ depth first at the end of out, returns its index.
+    // Big enough subtrees are built by other threads (while buildThreads has some) in their own array, then appended
+    unsigned int build(std::vector< PrimInfo > & infos, unsigned int begin, unsigned int end, int depth,
+        std::vector< Node > & out, int & out_max_depth) const;
+
+    // returns false if the range should stay a leaf. Otherwise infos[begin, mid[ and infos[mid, end[ are the two sides
+    bool partitionSAH(std::vector< PrimInfo > & infos, unsigned int begin, unsigned int end, const Node & node, int & axis, unsigned int & mid) const;
+
+    // turns the binary subtree under nodes[binary_idx] into wide nodes at the end of wide_nodes, returns its index
+    unsigned int collapse(unsigned int binary_idx);
+
+    // a leaf's triangles come first and are contiguous in tris: they are records [prims[offset].index, + this[
+    inline unsigned int leafTriangles(unsigned int offset, unsigned int n_prims) const;
+
+    inline void intersectLeaf(unsigned int offset, unsigned int n_prims, const Ray & r, RaySceneIntersection & result) const;
+    inline bool occludesLeaf(unsigned int offset, unsigned int n_prims, const Ray & r, float max_t) const;
+
+    // closest hit update for spheres, squares and instances, returns true if ref is closer than result
+    inline bool intersectPrimitive(const PrimRef & ref, const Ray & r, RaySceneIntersection & result) const;
+
+    inline bool occludes(const PrimRef & ref, const Ray & r, float max_t) const;
+};
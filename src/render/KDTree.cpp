@@ -2,13 +2,12 @@
 
 
 
-KDTree::KDTree(const std::vector< Mesh >& meshes){
-    int n_nodes = 0;
+KDTree::KDTree(const std::vector< Mesh >& meshes, BuildMode mode){
     // build the array
     Vec3 AABB_v1;
     Vec3 AABB_v2;
 
-    for (int i = 0; i < meshes.size(); ++i){
+    for (unsigned int i = 0; i < meshes.size(); ++i){
         const Mesh & mesh = meshes[i];
         for (const MeshTriangle & tri: mesh.triangles){
             Triangle t(
@@ -19,130 +18,248 @@ KDTree::KDTree(const std::vector< Mesh >& meshes){
 
             set_AABB(t, AABB_v1, AABB_v2);
 
-            tris.push_back({t, AABB_v1, AABB_v2, mesh.cull_backfaces, i});
+            tris.push_back({t, AABB_v1, AABB_v2, mesh.cull_backfaces, (int)i});
             
         }
     }
 
-    for (int i = 0; i < tris.size(); ++i){
+    bool use_cache = accelerationCache::enabled(tris.size());
+    uint64_t key = use_cache ? cacheKey(mode) : 0;
+    if (!use_cache || !loadCache(key)){
+        build(mode);
+        if (use_cache) saveCache(key);
+    }
+
+    // the leaves read these, in leaf_tris order
+    records.reserve(leaf_tris.size());
+    for (unsigned int idx: leaf_tris) records.push_back(tris[idx].triangle, tris[idx].cull_backface);
+}
+
+void KDTree::build(BuildMode mode){
+    if (tris.empty()) return; // no nodes at all, a leaf can't be empty
+
+    SpPointer root = std::make_unique<SplittingPlane>();
+    for (unsigned int i = 0; i < tris.size(); ++i){
         root->add_tri(&tris[i]);
     }
 
-    std::vector < std::reference_wrapper<SpPointer> > to_process = {root};
-    while (! to_process.empty()){
-        SpPointer & current = to_process.back(); to_process.pop_back();
-        n_nodes++;
+    BuildStats stats;
+    buildSubtree(*root, mode, stats);
+    max_depth = stats.max_depth;
+    //std::cout << "nodes  " << stats.n_nodes << std::endl;
+
+    nodes.reserve(stats.n_nodes);
+    leaf_tris.reserve(tris.size());
+    flatten(*root);
+    // the SplittingPlane tree dies with root here
+}
 
-        if (current->tris.size() <= MAX_TRIANGLES_PER_LEAF){
-            current->is_leaf = true;
-            continue;
+uint64_t KDTree::cacheKey(BuildMode mode) const {
+    accelerationCache::Hasher h;
+    h.add("kdtree");
+    h.add(mode);
+    h.add(sizeof(LinearNode));
+    h.add(MAX_DEPTH); h.add(MAX_TRIANGLES_PER_LEAF);
+    h.add(SAH_N_BINS); h.add(SAH_TRAVERSAL_COST); h.add(SAH_INTERSECTION_COST); h.add(SAH_MAX_TRIANGLES_PER_LEAF);
+
+    // the build only looks at the positions
+    for (const KdTriangle & t: tris){
+        for (int v = 0; v < 3; ++v){
+            Vec3 p = t.triangle[v];
+            h.add(p[0]); h.add(p[1]); h.add(p[2]);
         }
+    }
+    return h.value;
+}
 
-        int axis = current->axis;
-        current->first_side_child = std::make_unique<SplittingPlane>();
-        current->second_side_child = std::make_unique<SplittingPlane>();
+bool KDTree::loadCache(uint64_t key){
+    accelerationCache::Reader f("kdtree", key);
+    bool ok = f.read(max_depth) && max_depth < MAX_DEPTH && f.read(nodes) && f.read(leaf_tris);
 
-        // compute midpoint
-        float coord_mean = 0.0;
-        for (KdTriangle* t_p: current->tris){
-            coord_mean += t_p->triangle[0][axis];
-            coord_mean += t_p->triangle[1][axis];
-            coord_mean += t_p->triangle[2][axis];
-        }
-        coord_mean /= ((float)current->tris.size() * 3.0f);
+    // the key matched, but don't trust the file further than what the traversal indexes
+    for (unsigned int i = 0; ok && i < nodes.size(); ++i){
+        ok = nodes[i].is_leaf() ? (uint64_t)nodes[i].offset + nodes[i].n_tris <= leaf_tris.size() : nodes[i].offset < nodes.size();
+    }
+    for (unsigned int i = 0; ok && i < leaf_tris.size(); ++i) ok = leaf_tris[i] < tris.size();
+
+    if (!ok){
+        nodes.clear();
+        leaf_tris.clear();
+        max_depth = 0;
+    }
+    return ok;
+}
 
-        // separate the triangles
-        
-        SpPointer & child_1 = (current->first_side_child);
-        SpPointer & child_2 = (current->second_side_child);
-        child_1->axis = child_2->axis = (axis+1)%3;
+void KDTree::saveCache(uint64_t key) const {
+    accelerationCache::Writer f("kdtree", key);
+    f.write(max_depth);
+    f.write(nodes);
+    f.write(leaf_tris);
+    f.close();
+}
 
-        // TODO maybe do a branchless version based on https://stackoverflow.com/questions/38798841/how-do-i-write-a-branchless-stdvector-scan
-        for (KdTriangle* t_p: current->tris){
+bool KDTree::splitNode(SplittingPlane & current, BuildMode mode){
+    int axis = current.axis;
+    float split_pos;
 
-            float center = (t_p->triangle[0][axis] + t_p->triangle[1][axis] + t_p->triangle[2][axis])/3.0f;
+    bool split_found = current.depth < MAX_DEPTH - 1 && (
+        (mode == BuildMode_SAH) ?
+        current.findSAHSplit(axis, split_pos) :
+        current.findMeanSplit(axis, split_pos)
+    );
 
-            if (center <= coord_mean){        // marche avec les triangles à cheval car on update l'AABB du noeud anyway
-                child_1->add_tri(t_p);
-            } else{
-                child_2->add_tri(t_p);
-            }
+    if (!split_found){
+        current.is_leaf = true;
+        return false;
+    }
+
+    current.axis = axis;
+    current.first_side_child = std::make_unique<SplittingPlane>();
+    current.second_side_child = std::make_unique<SplittingPlane>();
+
+    // separate the triangles
+    
+    SplittingPlane & child_1 = *current.first_side_child;
+    SplittingPlane & child_2 = *current.second_side_child;
+    child_1.axis = child_2.axis = (axis+1)%3; // only used by the mean split
+    child_1.depth = child_2.depth = current.depth + 1;
+
+    // TODO maybe do a branchless version based on https://stackoverflow.com/questions/38798841/how-do-i-write-a-branchless-stdvector-scan
+    for (KdTriangle* t_p: current.tris){
+
+        if (triangle_center(t_p->triangle, axis) <= split_pos){        // marche avec les triangles à cheval car on update l'AABB du noeud anyway
+            child_1.add_tri(t_p);
+        } else{
+            child_2.add_tri(t_p);
         }
+    }
 
-        // safeguard for edge cases (ex: 46 triangles in exactly the same spot...)
-        
-        if (child_1->tris == current->tris || child_2->tris == current->tris ){ // TODO wait at least 3 iterations before calling it a day, so we try each dimension once
-            child_1->is_leaf = child_2->is_leaf = true;
+    // safeguard for edge cases (ex: 46 triangles in exactly the same spot, or a flat mesh split on its flat axis):
+    // everything went to one side, so the current node stays a leaf. Never make the empty side a leaf,
+    // the flattened tree tells leaves by their triangle count
+    if (child_1.tris.empty() || child_2.tris.empty()){ // TODO wait at least 3 iterations before calling it a day, so we try each dimension once
+        current.first_side_child.reset();
+        current.second_side_child.reset();
+        current.is_leaf = true;
+        return false;
+    }
+    current.tris.clear(); // free the memory if we're not a leaf
+    current.tris.shrink_to_fit();
+    return true;
+}
 
+void KDTree::buildSubtree(SplittingPlane & root, BuildMode mode, BuildStats & stats){
+    // the subtrees don't share anything, so a worker just takes one and builds it on its own
+    std::vector< std::thread > workers;
+    std::vector< std::unique_ptr< BuildStats > > workers_stats;
+
+    std::vector< SplittingPlane* > to_process = {&root};
+    while (! to_process.empty()){
+        SplittingPlane & current = *to_process.back(); to_process.pop_back();
+        stats.n_nodes++;
+        stats.max_depth = std::max(stats.max_depth, current.depth);
+
+        if (!splitNode(current, mode)) continue;
+
+        to_process.push_back(current.first_side_child.get());
+
+        if (current.second_side_child->tris.size() >= PARALLEL_MIN_TRIANGLES && buildThreads::tryAcquire()){
+            workers_stats.push_back(std::make_unique< BuildStats >());
+            SplittingPlane & subtree = *current.second_side_child;
+            BuildStats & subtree_stats = *workers_stats.back();
+            workers.emplace_back([&subtree, mode, &subtree_stats](){
+                buildSubtree(subtree, mode, subtree_stats);
+                buildThreads::release();
+            });
         } else {
-            to_process.push_back(current->first_side_child);
-            to_process.push_back(current->second_side_child);
+            to_process.push_back(current.second_side_child.get());
         }
-        tris.clear(); // free the memory if we're not a leaf
     }
-    //std::cout << "nodes  " << n_nodes << std::endl;
-}
 
-KDTree::KdIntersectionResult KDTree::getIntersection(const Ray & r) const{
-    return root->getIntersection(r);
+    for (size_t i = 0; i < workers.size(); ++i){
+        workers[i].join();
+        stats.n_nodes += workers_stats[i]->n_nodes;
+        stats.max_depth = std::max(stats.max_depth, workers_stats[i]->max_depth);
+    }
 }
 
+unsigned int KDTree::flatten(const SplittingPlane & node){
+    unsigned int idx = nodes.size();
+    nodes.push_back({node.AABB_v1, node.AABB_v2, 0, 0, (unsigned int)node.axis});
 
-inline void KDTree::SplittingPlane::add_tri(KdTriangle* tri){
+    if (node.is_leaf){
+        nodes[idx].offset = leaf_tris.size();
+        nodes[idx].n_tris = node.tris.size();
+        for (const KdTriangle * t_p: node.tris) leaf_tris.push_back(t_p - tris.data());
+        return idx;
+    }
 
-    tris.push_back(tri);
+    flatten(*node.first_side_child); // lands on idx+1
+    nodes[idx].offset = flatten(*node.second_side_child);
+    return idx;
+}
 
-    AABB_v1[0] = std::min(tri->AABB_v1[0], AABB_v1[0]); AABB_v1[1] = std::min(tri->AABB_v1[1], AABB_v1[1]); AABB_v1[2] = std::min(tri->AABB_v1[2], AABB_v1[2]);     
-    AABB_v2[0] = std::max(tri->AABB_v2[0], AABB_v2[0]); AABB_v2[1] = std::max(tri->AABB_v2[1], AABB_v2[1]); AABB_v2[2] = std::max(tri->AABB_v2[2], AABB_v2[2]);
+bool KDTree::SplittingPlane::findMeanSplit(int & split_axis, float & split_pos) const {
+    if (tris.size() <= MAX_TRIANGLES_PER_LEAF) return false;
+
+    // compute midpoint
+    float coord_mean = 0.0;
+    for (KdTriangle* t_p: tris){
+        coord_mean += t_p->triangle[0][split_axis];
+        coord_mean += t_p->triangle[1][split_axis];
+        coord_mean += t_p->triangle[2][split_axis];
+    }
+    split_pos = coord_mean / ((float)tris.size() * 3.0f);
+    return true;
 }
 
-bool KDTree::SplittingPlane::collideAABB(const Ray & r) const { // https://tavianator.com/2011/ray_box.html
+bool KDTree::SplittingPlane::findSAHSplit(int & split_axis, float & split_pos) const {
+    if (tris.size() <= 1) return false;
 
-    Vec3 aa1_to_r = AABB_v1 - r.origin();
-    Vec3 aa2_to_r = AABB_v2 - r.origin();
+    BinnedSplit split = binnedSAHSplit< SAH_N_BINS >(tris.size(),
+        [&](unsigned int i, int a){ return triangle_center(tris[i]->triangle, a); },
+        [&](unsigned int i) -> const KdTriangle & { return *tris[i]; },
+        surfaceArea(), SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, tris.size() >= PARALLEL_BINNING_MIN_TRIANGLES
+    );
 
-    float tx1 = (aa1_to_r[0]) * r.invdir[0];
-    float tx2 = (aa2_to_r[0]) * r.invdir[0];
+    if (!split.found()) return false; // all the centers are in the same spot
+    split_axis = split.axis;
+    split_pos = split.position();
 
-    float tmin = std::min(tx1, tx2);
-    float tmax = std::max(tx1, tx2);
+    float leaf_cost = SAH_INTERSECTION_COST * tris.size();
+    return split.cost < leaf_cost || tris.size() > SAH_MAX_TRIANGLES_PER_LEAF;
+}
 
-    float ty1 = (aa1_to_r[1]) * r.invdir[1];
-    float ty2 = (aa2_to_r[1]) * r.invdir[1];
 
-    tmin = std::max(tmin, std::min(ty1, ty2));
-    tmax = std::min(tmax, std::max(ty1, ty2));
+inline void KDTree::SplittingPlane::add_tri(KdTriangle* tri){
 
-    float tz1 = (aa1_to_r[2]) * r.invdir[2];
-    float tz2 = (aa2_to_r[2]) * r.invdir[2];
+    tris.push_back(tri);
 
-    tmin = std::max(tmin, std::min(tz1, tz2));
-    tmax = std::min(tmax, std::max(tz1, tz2));
+    AABB_v1[0] = std::min(tri->AABB_v1[0], AABB_v1[0]); AABB_v1[1] = std::min(tri->AABB_v1[1], AABB_v1[1]); AABB_v1[2] = std::min(tri->AABB_v1[2], AABB_v1[2]);     
+    AABB_v2[0] = std::max(tri->AABB_v2[0], AABB_v2[0]); AABB_v2[1] = std::max(tri->AABB_v2[1], AABB_v2[1]); AABB_v2[2] = std::max(tri->AABB_v2[2], AABB_v2[2]);
+}
 
-    return tmax >= tmin;
-    return tmax >= tmin;
+float KDTree::SplittingPlane::surfaceArea() const {
+    return AABB_surface_area(AABB_v1, AABB_v2);
 }
 
 bool KDTree::hasIntersection(const Ray & r, float max_t) const{ // iterative because then we can return once and don't have to wait for the whole stack
-    std::vector < std::reference_wrapper<const SpPointer> > to_process = {root};
-    while (! to_process.empty()){
-        const SpPointer & current = to_process.back(); to_process.pop_back();
-        if (!current->collideAABB(r)) continue;
+    if (nodes.empty()) return false;
 
-        if (current->is_leaf){
+    KdTraversalStack to_process;
+    to_process.push(0);
+    while (! to_process.empty()){
+        const LinearNode & current = nodes[to_process.pop()];
+        float t_entry;
+        if (!current.collideAABB(r, MIN_OFFSET_VALUE, max_t, t_entry)) continue;
 
-            RayTriangleIntersection candidate;
+        if (current.is_leaf()){
 
-            for (const KdTriangle * tri: current->tris){
-                candidate = tri->triangle.intersect(r, false);
-                if (candidate.intersectionExists && candidate.t > MIN_OFFSET_VALUE && candidate.t < max_t){
-                    return true;
-                }
-            }
+            if (records.anyHit(current.offset, current.offset + current.n_tris, r, MIN_OFFSET_VALUE, max_t)) return true;
         }
         else{
-            to_process.push_back(current->first_side_child);
-            to_process.push_back(current->second_side_child);
+            to_process.push(&current - nodes.data() + 1);
+            to_process.push(current.offset);
         }
     }
     return false;
@@ -150,35 +267,43 @@ bool KDTree::hasIntersection(const Ray & r, float max_t) const{ // iterative bec
 
 
 
+RaySceneIntersection KDTree::getIntersection(const Ray & r) const{
+    RaySceneIntersection result;
+    if (nodes.empty()) return result;
 
-const KDTree::KdIntersectionResult final_result;
+    unsigned int closest = 0; // record of the closest hit, the full result is only built for it at the end
+
+    KdTraversalStack to_process;
+    to_process.push(0);
+
+    while (! to_process.empty()){
+        const LinearNode & current = nodes[to_process.pop()];
 
-KDTree::KdIntersectionResult KDTree::SplittingPlane::getIntersection(const Ray & r) const {
-    if (!collideAABB(r)) return final_result;
+        // boxes are allowed to overlap, so we can't stop at the first hit, only skip what starts behind it
+        float t_entry;
+        if (!current.collideAABB(r, 0.0f, result.t, t_entry)) continue;
 
-    if (is_leaf){
-        RayTriangleIntersection result;
-        RayTriangleIntersection candidate;
-        int meshIndex;
+        if (current.is_leaf()){
 
-        for (const KdTriangle * tri: tris){
-            candidate = tri->triangle.intersect(r, tri->cull_backface);
-            if (candidate.intersectionExists && candidate.t < result.t){
-                result = candidate;
-                meshIndex = tri->meshIndex;
+            int hit = records.closestHit(current.offset, current.offset + current.n_tris, r, MIN_OFFSET_VALUE, result.t);
+            if (hit >= 0){
+                result.intersectionExists = true;
+                closest = hit;
             }
         }
-        return {result, meshIndex};
+        else{
+            // the first child holds the lower side of the split, push the far one first so the near one is popped first
+            unsigned int first = &current - nodes.data() + 1;
+            unsigned int second = current.offset;
+            if (r.direction()[current.axis] >= 0.0f) std::swap(first, second);
+            to_process.push(first);
+            to_process.push(second);
+        }
     }
-    else{
-        KdIntersectionResult res1 = first_side_child->getIntersection(r);
-        KdIntersectionResult res2 = second_side_child->getIntersection(r);
-
-        if (!res1.triangleIntersection.intersectionExists) return res2;
-        if (!res2.triangleIntersection.intersectionExists) return res1;
-        if (res1.triangleIntersection.t <= res2.triangleIntersection.t) return res1; else return res2;
-
+    if (result.intersectionExists){
+        result.rayMeshIntersection = records.hit(closest, r, result.t);
+        result.typeOfIntersectedObject = INTERSECTION_MESH;
+        result.objectIndex = tris[leaf_tris[closest]].meshIndex;
     }
-
+    return result;
 }
-
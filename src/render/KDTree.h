@@ -4,43 +4,102 @@
 #include <memory>
 #include "src/mesh/Mesh.h"
 #include "src/mesh/Triangle.h"
+#include "AccelerationStructure.h"
+#include "AccelerationCache.h"
+#include "TriangleRecords.h"
 #include <utility>
 #include <functional>
 #include <array>
+#include <thread>
 
-static inline void set_AABB(const Triangle& t, Vec3 & res1, Vec3 & res2){
 
-    res1 = t[0];
-    res2 = t[0];
-    for (const Vec3 & vertex: {t[1], t[2]}){
-        res1[0] = std::min(vertex[0], res1[0]); res1[1] = std::min(vertex[1], res1[1]); res1[2] = std::min(vertex[2], res1[2]);     
-        res2[0] = std::max(vertex[0], res2[0]); res2[1] = std::max(vertex[1], res2[1]); res2[2] = std::max(vertex[2], res2[2]);
-    }
-}
-
-
-class KDTree{
+class KDTree: public AccelerationStructure{
 protected:
     class SplittingPlane;
     struct KdTriangle {Triangle triangle; Vec3 AABB_v1; Vec3 AABB_v2; bool cull_backface = true; const int meshIndex;};
 
+    // what the traversal actually reads. The SplittingPlane tree is only used during the build,
+    // then it's flattened depth first: the first child of an interior node is always the next node.
+    struct LinearNode {
+        Vec3 AABB_v1;
+        Vec3 AABB_v2;
+        unsigned int offset;    // leaf: first index in leaf_tris. interior: index of the second child
+        unsigned int n_tris : 30;  // 0 for interior nodes, a leaf always has at least one
+        unsigned int axis : 2;
+
+        inline bool is_leaf() const { return n_tris > 0; }
+        inline bool collideAABB(const Ray & r, float t_min, float t_max, float & t_entry) const {
+            return collide_AABB(AABB_v1, AABB_v2, r, t_min, t_max, t_entry);
+        }
+    };
+    static_assert(sizeof(LinearNode) == 32, "LinearNode should fit twice in a cache line");
+
     using SpPointer = std::unique_ptr<SplittingPlane>;
 
-    static const int MAX_TRIANGLES_PER_LEAF = 3; //3 est optimum apparement
+    static const int MAX_TRIANGLES_PER_LEAF = 3; //3 est optimum apparement (mean split only)
+
+    // binned SAH, see binnedSAHSplit
+    static const int SAH_N_BINS = 16;
+    static constexpr float SAH_TRAVERSAL_COST = 1.0f;
+    static constexpr float SAH_INTERSECTION_COST = 1.0f; // relative to a traversal step
+    static const int SAH_MAX_TRIANGLES_PER_LEAF = 16; // forces a split even if the SAH says otherwise
+
+    // nodes at this depth are always leaves, so traversal stacks can live on the stack instead of the heap
+    static const int MAX_DEPTH = 64;
+
+    using KdTraversalStack = TraversalStack< MAX_DEPTH + 1 >;
+
+    // subtrees at least this big are handed to another thread while there are some left
+    static const int PARALLEL_MIN_TRIANGLES = 4096;
+    // and above this the three axes of the SAH are binned at the same time, for the first levels
+    static const int PARALLEL_BINNING_MIN_TRIANGLES = 65536;
+
+    struct BuildStats {int n_nodes = 0; int max_depth = 0;};
 public:
-    struct KdIntersectionResult {RayTriangleIntersection triangleIntersection; int meshIndex=0; KdIntersectionResult() = default;};
-    
-    SpPointer root = std::make_unique<SplittingPlane>();
+    enum BuildMode {
+        BuildMode_MeanSplit, // split at the mean vertex, round robin on the axes
+        BuildMode_SAH
+    };
 
+
+    
     std::vector< KdTriangle > tris;
 
+    std::vector< LinearNode > nodes;
+    std::vector< unsigned int > leaf_tris; // indices in tris, every leaf is a contiguous range
+    TriangleRecords records; // what the leaves test, one per leaf_tris entry
+
+    int max_depth = 0; // of the built tree, root is 0. Always < MAX_DEPTH
+
     KDTree() = default;
 
-    explicit KDTree(const std::vector< Mesh >& meshes);
+    explicit KDTree(const std::vector< Mesh >& meshes, BuildMode mode = BuildMode_SAH);
+
+    RaySceneIntersection getIntersection(const Ray & r) const override;
+
+    bool hasIntersection(const Ray & r, float max_t) const override;
+
+    bool coversWholeScene() const override { return false; }
+
+    const char * name() const override { return "Scene-wide KdTree"; }
+
+private:
+    // splits node in two children. False if there is nothing more to build under it
+    static bool splitNode(SplittingPlane & node, BuildMode mode);
+
+    // builds everything under root, big enough subtrees go to other threads while buildThreads has some
+    static void buildSubtree(SplittingPlane & root, BuildMode mode, BuildStats & stats);
+
+    // fills nodes, leaf_tris and max_depth from tris
+    void build(BuildMode mode);
 
-    KdIntersectionResult getIntersection(const Ray & r) const;
+    unsigned int flatten(const SplittingPlane & node);
 
-    bool hasIntersection(const Ray & r, float max_t) const;
+    // hash of the triangles and of everything that changes the tree
+    uint64_t cacheKey(BuildMode mode) const;
+    // false if there is no usable file, the tree is left empty then
+    bool loadCache(uint64_t key);
+    void saveCache(uint64_t key) const;
 };
 
 
@@ -48,7 +107,9 @@ public:
 class KDTree::SplittingPlane {
     friend KDTree;
 private:
-    bool collideAABB(const Ray & r) const;
+    // both return false if the node should stay a leaf
+    bool findMeanSplit(int & split_axis, float & split_pos) const;
+    bool findSAHSplit(int & split_axis, float & split_pos) const;
 public:
 
     SpPointer first_side_child;
@@ -56,6 +117,7 @@ public:
 
     bool is_leaf = false;
     int axis = 0;
+    int depth = 0;
 
     std::vector< KdTriangle* > tris;
 
@@ -66,5 +128,5 @@ public:
 
     void add_tri(KdTriangle* tri);
 
-    KdIntersectionResult getIntersection(const Ray & r) const;
+    float surfaceArea() const;
 };
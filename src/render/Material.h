@@ -3,16 +3,15 @@
 #include "src/utils/Vec3.h"
 #include <cmath>
 #include <memory>
-#include <random>
 #include <GL/glut.h>
 #include "src/utils/Texture.h"
+#include "Sampler.h"
 #include <algorithm>
 
 
 static float randomUnitFloat()
 {   // in (-1, 1)
-    static thread_local std::mt19937 rng(std::random_device{}());
-    return (float)(rng()) * (2.0 / (float)(rng.max())) - 1.0;
+    return Sampler::threadLocal() * 2.0f - 1.0f;
 }
 
 
@@ -41,6 +40,15 @@ struct Light {
         return pos + Vec3(randomUnitFloat(), randomUnitFloat(), randomUnitFloat()) * radius;
     }
 
+    // same, the point taken from the path's samples
+    Vec3 getRandomTarget(SampleStream & stream) const {
+        stream.startGroup();
+        float x = stream.next();
+        float y = stream.next();
+        float z = stream.next();
+        return pos + Vec3(2 * x - 1, 2 * y - 1, 2 * z - 1) * radius;
+    }
+
     void draw() const { // simple debug draw for volume of light
 
         glPointSize(5);   
@@ -15,20 +15,11 @@
 #include "Postprocess.h"
 #include "Renderer.h"
 
-static int total_threads_n;
-static int count = 0;
-static inline void print_advancement(){
-    std::cout << "\r\t\033[36mBlocks remaining: \033[31m" << total_threads_n - count << " / " << total_threads_n << "            \033[36m" << std::flush;
-}
-
-inline int thread_idx_from_coord(int x, int y, int w){
-    return (x + y * w);
-}
-void postProcessSquare(Renderer & renderer, PostProcessEffect & posteffect, int pos_x, int pos_y, int sizeX, int sizeY, std::mutex & mtx){
+void postProcessSquare(Renderer & renderer, PostProcessEffect & posteffect, int pos_x, int pos_y, int sizeX, int sizeY, Progress & progress){
 
 
-    for (int u=pos_x; u<pos_x+sizeX; u++){
-        for (int v = pos_y; v<pos_y+sizeY; v++) {
+    for (int v = pos_y; v<pos_y+sizeY; v++) { // rows, the planes are row major
+        for (int u=pos_x; u<pos_x+sizeX; u++){
             Vec3 out(0, 0, 0);
             posteffect.fragment(
                 u, v, out,
@@ -40,85 +31,27 @@ void postProcessSquare(Renderer & renderer, PostProcessEffect & posteffect, int
                 posteffect.h
             );
             
-            renderer.workspace[u + v * posteffect.w] = Color(out);
+            renderer.workspace.set(u + v * posteffect.w, out);
         }
     }
-    std::scoped_lock<std::mutex> lock(mtx);
-    ++count;
-    if (!renderer.silent) print_advancement();
+    progress.advance(1);
 }
 
 void PostProcessEffect::postProcessMultithreaded(Renderer & renderer){
     const unsigned int area_size = 40;
 
-    int n_square_x = renderer.w / area_size;
-    int rest_x = renderer.w % area_size;
-
-    int n_square_y = renderer.h / area_size;
-    int rest_y = renderer.h % area_size;
-
-    int n_threads = (n_square_x+1) * (n_square_y+1);
-
-    std::thread threads[n_threads];
+    std::vector< Tile > tiles = splitInTiles(renderer.w, renderer.h, area_size);
 
-    std::mutex threads_finished_count_mutex;
+    Progress progress("Blocks", tiles.size(), renderer.silent);
 
-    total_threads_n = n_threads;
-    count = 0;
-    if (!renderer.silent) print_advancement();
-    
-    // full squares
-    for (int i = 0; i < n_square_x; i+=1){
-        for (int j = 0; j < n_square_y; j+=1){
-            
-            threads[thread_idx_from_coord(i, j, n_square_x+1)] = std::thread(
-                postProcessSquare,
-                std::ref(renderer), std::ref(*this),
-                area_size * i, area_size * j, // pos of square (top left corner)
-                area_size, area_size, // size of square
-                std::ref(threads_finished_count_mutex)
-            );
-        }
-    }
-    
-    // bottom rest
-    int j_last = (n_square_y);
-    for (int i = 0; i < n_square_x; i+=1){
-
-        threads[thread_idx_from_coord(i, j_last, n_square_x+1)] = std::thread(
-            postProcessSquare,
-            std::ref(renderer), std::ref(*this),
-            area_size * i, area_size * j_last, // pos of square (top left corner)
-            area_size, rest_y, // size of square
-            std::ref(threads_finished_count_mutex)
+    ThreadPool::shared().parallelFor(tiles.size(), [&](unsigned int t){
+        postProcessSquare(
+            renderer, *this,
+            tiles[t].x, tiles[t].y, // pos of square (top left corner)
+            tiles[t].w, tiles[t].h, // size of square
+            progress
         );
-
-    }
-    // right rest
-    int i_last = (n_square_x);
-    for (int j = 0; j < n_square_y; j+=1){
-
-        threads[thread_idx_from_coord(i_last, j, n_square_x+1)] = std::thread(
-            postProcessSquare,
-            std::ref(renderer), std::ref(*this),
-            area_size * i_last, area_size * j, // pos of square (top left corner)
-            rest_x, area_size, // size of square
-            std::ref(threads_finished_count_mutex)
-        );
-    }
-
-    // very last, bottom right square
-    threads[thread_idx_from_coord(i_last, j_last, n_square_x+1)] = std::thread(
-        postProcessSquare,
-        std::ref(renderer), std::ref(*this),
-        area_size * i_last, area_size * j_last, // pos of square (top left corner)
-        rest_x, rest_y, // size of square
-        std::ref(threads_finished_count_mutex)
-    );
-    
-    for (int t = 0; t < n_threads; ++t){
-        threads[t].join();
-    }
+    });
 }
 
 
@@ -138,7 +71,7 @@ void PostProcessEffect::postProcessSinglethreaded(Renderer& renderer){
                 renderer.h,
                 renderer.w
             );
-            renderer.workspace[u + v * w] = Color(out);
+            renderer.workspace.set(u + v * w, out);
         }
     }
 }
@@ -170,10 +103,8 @@ inline int PostProcessEffect::idx_from_coord(int u, int v) const{
     //if (u >= w-1 || v >= h-1) std::cout << u << " " << v << std::endl;
     return u + v * w;
 }
-inline Vec3 PostProcessEffect::sampleBuffer(const std::vector< Color > & buffer, int x, int y) const {
-    auto v = buffer[idx_from_coord(x, y)];
-
-    return Vec3(v.r / 255.0, v.g / 255.0, v.b / 255.0);
+inline Vec3 PostProcessEffect::sampleBuffer(const FrameBuffer & buffer, int x, int y) const {
+    return buffer.get(idx_from_coord(x, y));
 }
 
 inline float PostProcessEffect::sampleBuffer(const std::vector< float > & buffer, int x, int y) const{
@@ -181,9 +112,9 @@ inline float PostProcessEffect::sampleBuffer(const std::vector< float > & buffer
 }
 
 // not private juste in case but don't go around writing in the wrong buffers!
-inline void PostProcessEffect::writeToBuffer(std::vector< Color > & buffer, int x, int y, Color elt) const {
+inline void PostProcessEffect::writeToBuffer(FrameBuffer & buffer, int x, int y, const Vec3 & elt) const {
 
-    buffer[idx_from_coord(x, y)] = elt;
+    buffer.set(idx_from_coord(x, y), elt);
 }
 
 
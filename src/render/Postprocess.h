@@ -13,6 +13,7 @@
 #include <random>
 #include "src/utils/Vec3.h"
 #include "src/utils/Color.h"
+#include "src/utils/FrameBuffer.h"
 
 class Renderer;
 
@@ -27,11 +28,11 @@ public:
     inline int idx_from_coord(int u, int v) const;
 
 
-    inline Vec3 sampleBuffer(const std::vector< Color > & buffer, int x, int y) const;
+    inline Vec3 sampleBuffer(const FrameBuffer & buffer, int x, int y) const;
     inline float sampleBuffer(const std::vector< float > & buffer, int x, int y) const;
 
     // not private juste in case but don't go around writing in the wrong buffers!
-    inline void writeToBuffer(std::vector< Color > & buffer, int x, int y, Color elt) const;
+    inline void writeToBuffer(FrameBuffer & buffer, int x, int y, const Vec3 & elt) const;
 
 
     static const bool needs_normals = false;
@@ -43,9 +44,9 @@ public:
 
     virtual void fragment(
         int u, int v, Vec3 & OUT,
-        const std::vector< Color > & IMAGE,
-        const std::vector< Color > & RAW_IMAGE,
-        const std::vector< Color > & NORMAL,
+        const FrameBuffer & IMAGE,
+        const FrameBuffer & RAW_IMAGE,
+        const FrameBuffer & NORMAL,
         const std::vector< float > & DEPTH,
         int w, int h
     ) {
@@ -54,7 +55,8 @@ public:
 
 };
 
-#define FRAGMENT fragment(int u, int v, Vec3 & OUT,const std::vector< Color > & IMAGE,const std::vector< Color > & RAW_IMAGE,const std::vector< Color > & NORMAL,const std::vector< float > & DEPTH, int w, int h)
+// the buffers are linear and unclamped, OUT too: values over 1 go on to the next effect as they are
+#define FRAGMENT fragment(int u, int v, Vec3 & OUT,const FrameBuffer & IMAGE,const FrameBuffer & RAW_IMAGE,const FrameBuffer & NORMAL,const std::vector< float > & DEPTH, int w, int h)
 // effects
 
 namespace postprocess::kernel{
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+
+// how far a render (or a post effect) is, shared by its workers. They only bump an atomic counter, the printing is
+// done by a reporter thread of its own every REPORT_PERIOD, so no worker ever waits on a lock or on the terminal
+class Progress {
+    static constexpr std::chrono::milliseconds REPORT_PERIOD{100};
+
+    const char * unit;
+    long total;
+    std::atomic< long > done{0};
+
+    std::thread reporter; // only when not silent
+    std::mutex mtx;
+    std::condition_variable stop_requested;
+    bool stopped = false;
+
+    void print() const {
+        std::cout << "\r\t\033[36m" << unit << " remaining: \033[31m" << total - done.load(std::memory_order_relaxed) << " / " << total << "            \033[36m" << std::flush;
+    }
+
+public:
+    Progress(const char * unit, long total, bool silent) : unit(unit), total(total) {
+        if (silent) return;
+        reporter = std::thread([this]{
+            std::unique_lock< std::mutex > lock(mtx);
+            do {
+                print();
+            } while (!stop_requested.wait_for(lock, REPORT_PERIOD, [this]{ return stopped; }));
+            print(); // the final count
+        });
+    }
+
+    ~Progress(){
+        if (!reporter.joinable()) return;
+        {
+            std::scoped_lock< std::mutex > lock(mtx);
+            stopped = true;
+        }
+        stop_requested.notify_one();
+        reporter.join();
+    }
+
+    Progress(const Progress &) = delete;
+    Progress & operator=(const Progress &) = delete;
+
+    void advance(long n){
+        done.fetch_add(n, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cfloat>
+#include <cassert>
+#include "src/mesh/Triangle.h"
+#include "src/mesh/Sphere.h"
+#include "src/mesh/Square.h"
+
+
+enum INTERSECTION_TYPE {
+    INTERSECTION_MESH,
+    INTERSECTION_SPHERE,
+    INTERSECTION_SQUARE,
+    INTERSECTION_INSTANCE, // a mesh hit, already brought back in world space
+    INTERSECTION_LIGHT
+};
+
+class RaySceneIntersection{
+    public:
+        bool intersectionExists;
+        unsigned int typeOfIntersectedObject = INTERSECTION_MESH;
+        unsigned int objectIndex = -1; // no object until there's a hit
+        float t;
+
+        RayTriangleIntersection rayMeshIntersection;
+        RaySphereIntersection raySphereIntersection;
+        RaySquareIntersection raySquareIntersection;
+
+        RaySceneIntersection() : intersectionExists(false) , t(FLT_MAX) {}
+
+        const Vec3& get_normal() const{
+            switch (typeOfIntersectedObject){
+                case INTERSECTION_MESH:
+                case INTERSECTION_INSTANCE:
+                    return rayMeshIntersection.normal;
+                case INTERSECTION_SPHERE:
+                    return raySphereIntersection.normal;
+                case INTERSECTION_SQUARE:
+                    return raySquareIntersection.normal;
+            }
+            assert(!"no such intersection type");
+            return rayMeshIntersection.normal;
+        }
+
+        const Vec3& get_position() const{
+            switch (typeOfIntersectedObject){
+                case INTERSECTION_MESH:
+                case INTERSECTION_INSTANCE:
+                    return rayMeshIntersection.intersection;
+                case INTERSECTION_SPHERE:
+                    return raySphereIntersection.intersection;
+                case INTERSECTION_SQUARE:
+                    return raySquareIntersection.intersection;
+            }
+            assert(!"no such intersection type");
+            return rayMeshIntersection.intersection;
+        }
+        const Vec2& get_uv() const{
+            switch (typeOfIntersectedObject){
+                case INTERSECTION_MESH:
+                case INTERSECTION_INSTANCE:
+                    return rayMeshIntersection.uv;
+                case INTERSECTION_SPHERE:
+                    return raySphereIntersection.uv;
+                case INTERSECTION_SQUARE:
+                    return raySquareIntersection.uv;
+            }
+            assert(!"no such intersection type");
+            return rayMeshIntersection.uv;
+        }
+
+};
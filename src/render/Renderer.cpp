@@ -12,6 +12,8 @@
 #include <functional>
 #include <array>
 #include <iterator>
+#include <numeric>
+#include <cmath>
 #include <chrono>
 #include <thread>
 #include <mutex>
@@ -23,34 +25,165 @@
 #include "src/utils/Color.h"
 
 #include "src/utils/matrixUtilities.h"
+#include "Wavefront.h"
+
+
+CameraView CameraView::fromOpenGL(){
+    CameraView view;
+    getInvModelView(view.inv_model_view.data());
+    getInvProj(view.inv_proj.data());
+    getNearAndFarPlanes(view.near_far_planes.data());
+    glMatrixMode (GL_MODELVIEW);
+    view.position = cameraSpaceToWorldSpace(view.inv_model_view.data(), Vec3(0,0,0) );
+    return view;
+}
 
 
 void Renderer::render(Camera & camera, const Scene & scene, bool export_after /*= true*/){
-    if (!silent) std::cout << "\n\033[36mRay tracing a \033[31m" << w << " x " << h << " (x " << nsamples << " samples) \033[36mimage" << std::endl;
     camera.apply();
+    render(CameraView::fromOpenGL(), scene, export_after);
+}
+
+
+void Renderer::render(const CameraView & view, const Scene & scene, bool export_after /*= true*/){
+    if (!silent) std::cout << "\n\033[36mRay tracing a \033[31m" << w << " x " << h << " (x " << nsamples << " samples) \033[36mimage" << std::endl;
+
+    resetAccumulation();
+
+    if (adaptive_threshold > 0.0f){
+        // small passes, the pixels that converged aren't in the next ones
+        auto start = std::chrono::system_clock::now();
+        unsigned int active;
+        while ((active = updateActivePixels()) > 0 && tracePass(view, scene, adaptive_min_samples, false)){
+            if (!silent) std::clog << "\r\t\033[36mNoisy pixels: \033[31m" << active << "            " << std::flush;
+        }
+        std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+        if (!silent){
+            double average = std::accumulate(pixel_samples.begin(), pixel_samples.end(), 0.0) / (w * h);
+            std::clog << "\r\tDone in \033[31m" << elapsed_seconds.count() << "s\033[36m, \033[31m" << average << "\033[36m samples per pixel on average" << std::endl;
+        }
+    } else {
+        tracePass(view, scene, nsamples, !silent);
+    }
+    finishImage(!silent);
+
+    if (export_after) export_to_file();
+}
+
+
+void Renderer::resetAccumulation(){
+    std::fill(color_sum.begin(), color_sum.end(), Vec3(0,0,0));
+    std::fill(normal_sum.begin(), normal_sum.end(), Vec3(0,0,0));
+    std::fill(depth_min.begin(), depth_min.end(), 0.0f);
+    std::fill(pixel_samples.begin(), pixel_samples.end(), 0);
+    std::fill(luminance_sq_sum.begin(), luminance_sq_sum.end(), 0.0f);
+    *cancel_requested = false;
+}
+
+
+unsigned int Renderer::accumulatedSamples() const {
+    return *std::min_element(pixel_samples.begin(), pixel_samples.end());
+}
+
+
+bool Renderer::renderPass(const CameraView & view, const Scene & scene, unsigned int samples){
+    bool complete = tracePass(view, scene, samples, false);
+    finishImage(false);
+    return complete;
+}
+
+
+void Renderer::renderProgressive(const CameraView & view, const Scene & scene, unsigned int samples_per_pass, double time_budget /*= 0.0*/,
+    const std::function< void(unsigned int) > & on_pass /*= nullptr*/){
+
+    if (!silent) std::cout << "\n\033[36mProgressively ray tracing a \033[31m" << w << " x " << h << " (x " << nsamples << " samples) \033[36mimage" << std::endl;
+
+    auto start = std::chrono::system_clock::now();
+    while (updateActivePixels() > 0 && !*cancel_requested){
+        tracePass(view, scene, samples_per_pass, false); // the pixels close to maxSamples() get less
+        finishImage(false);
+        unsigned int accumulated = accumulatedSamples();
+
+        std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - start;
+        if (!silent) std::clog << "\r\t\033[36mSamples: \033[31m" << accumulated << " / " << nsamples << "\033[36m in \033[31m" << elapsed_seconds.count() << "s              " << std::flush;
+        if (on_pass) on_pass(accumulated);
+
+        if (time_budget > 0.0 && elapsed_seconds.count() >= time_budget) break;
+    }
+    if (!silent) std::clog << std::endl;
+}
+
+
+bool Renderer::converged(int p) const {
+    unsigned int n = pixel_samples[p];
+    if (n < 2) return false;
+    float mean = color_sum[p].luminance() / n;
+    float variance = std::max(0.0f, (luminance_sq_sum[p] / n - mean * mean) * n / (n - 1));
+    return 1.96f * std::sqrt(variance / n) <= adaptive_threshold;
+}
+
+
+unsigned int Renderer::updateActivePixels(){
+    unsigned int n_active = 0;
+    if (adaptive_threshold <= 0.0f){
+        for (int p = 0; p < w*h; ++p){
+            pixel_active[p] = pixel_samples[p] < nsamples;
+            n_active += pixel_active[p];
+        }
+        return n_active;
+    }
+
+    double spent = std::accumulate(pixel_samples.begin(), pixel_samples.end(), 0.0);
+    bool budget_left = spent < (double)nsamples * w * h;
+    for (int p = 0; p < w*h; ++p){
+        pixel_active[p] = pixel_samples[p] < adaptive_min_samples
+            || (budget_left && pixel_samples[p] < ADAPTIVE_MAX_FACTOR * nsamples && !converged(p));
+        n_active += pixel_active[p];
+    }
+    return n_active;
+}
 
 
+bool Renderer::tracePass(const CameraView & view, const Scene & scene, unsigned int samples, bool verbose){
     auto start = std::chrono::system_clock::now();
 
+    updateActivePixels();
     //ray_trace_from_camera_singlethreaded(*this, scene);
-    ray_trace_from_camera_multithreaded(*this, scene);
+    ray_trace_from_camera_multithreaded(*this, scene, view, samples, verbose);
+    resolve();
 
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed_seconds = end-start;
-    if (!silent) std::clog <<"\r\tDone in \033[31m" << elapsed_seconds.count() << "s              " << std::flush << std::endl; //spaces to overwrite
+    if (verbose) std::clog <<"\r\tDone in \033[31m" << elapsed_seconds.count() << "s              " << std::flush << std::endl; //spaces to overwrite
+
+    return !*cancel_requested;
+}
+
 
+void Renderer::finishImage(bool verbose){
     result_image = image;
 
-    if (!postProcessPipeline.empty()){
-        if (!silent) std::cout << "\033[36mApplying post-processing" << std::endl;
-        start = std::chrono::system_clock::now();
-        postProcess();
-        end = std::chrono::system_clock::now();
-        elapsed_seconds = end-start;
-    if (!silent) std::clog <<"\r\tDone in \033[31m" << elapsed_seconds.count() << "s              " << std::flush << std::endl; //spaces to overwrite
-    }
+    if (postProcessPipeline.empty()) return;
 
-    if (export_after) export_to_file();
+    bool was_silent = silent;
+    silent = !verbose;
+    if (verbose) std::cout << "\033[36mApplying post-processing" << std::endl;
+    auto start = std::chrono::system_clock::now();
+    postProcess();
+    auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    if (verbose) std::clog <<"\r\tDone in \033[31m" << elapsed_seconds.count() << "s              " << std::flush << std::endl; //spaces to overwrite
+    silent = was_silent;
+}
+
+
+void Renderer::resolve(){
+    for (int p = 0; p < w*h; ++p){
+        if (pixel_samples[p] == 0) continue;
+        image.set(p, color_sum[p] / pixel_samples[p]);
+        screen_space_normals.set(p, normal_sum[p] / pixel_samples[p]);
+        screen_space_depth[p] = depth_min[p];
+    }
 }
 
 
@@ -58,8 +191,7 @@ void Renderer::postProcess(){
 
     for (int i =0; i < postProcessPipeline.size(); ++i){
         postProcessPipeline[i]->apply(*this); // computes the result inside workspace
-        result_image = workspace;//std::move(workspace);
-        workspace = std::vector< Color >(w*h, Color());
+        std::swap(result_image, workspace); // every pixel of workspace gets written by the next effect
     }
 }
 
@@ -69,9 +201,10 @@ void Renderer::export_to_file(const std::string & filename /*= "./rendu.ppm"*/){
         std::cout << "Could not open file: " << filename << std::endl;
         return;
     }
+    const std::vector< Color > & colors = getImage();
     f << "P3" << std::endl << w << " " << h << std::endl << 255 << std::endl;
     for (int i=0; i<w*h; i++)
-        f << (int)result_image[i][0] << " " << (int)result_image[i][1] << " " << (int)result_image[i][2] << " ";
+        f << (int)colors[i][0] << " " << (int)colors[i][1] << " " << (int)colors[i][2] << " ";
     f << std::endl;
     f.close();
 }
@@ -83,135 +216,165 @@ inline int idx_from_coord(int x, int y, int w){
 }
 
 
-std::array< GLdouble, 16 > inv_model_view, inv_proj;
-std::array< GLdouble, 2 >  near_far_planes;
-
-int total_threads_n;
-int count = 0;
-inline void print_advancement(){
-    std::cout << "\r\t\033[36mBlocks remaining: \033[31m" << total_threads_n - count << " / " << total_threads_n << "            \033[36m" << std::flush;
-}
-
-void ray_trace_square(Renderer & renderer, const Scene & scene, int pos_x, int pos_y, int sizeX, int sizeY, std::mutex & mtx){
-
-
-    static thread_local std::mt19937 rng(std::random_device{}());
-
-    Vec3 pos = cameraSpaceToWorldSpace(inv_model_view.data(), Vec3(0,0,0) );
-    Vec3 dir;
-    int p;
-    RayResult acc;
-    for (int y=pos_y; y<pos_y+sizeY; y++){
-        for (int x = pos_x; x<pos_x+sizeX; x++) {
-            acc = RayResult();
-            p = idx_from_coord(x,y , renderer.w);
-
-            for( unsigned int s = 0 ; s < renderer.nsamples ; ++s ) {
+void ray_trace_square(Renderer & renderer, const Scene & scene, RenderContext & context, int pos_x, int pos_y, int sizeX, int sizeY){
+
+
+    const CameraView & view = context.view;
+    const Vec3 & pos = view.position;
+
+    // the sample's path starts here, its first two dimensions are the jitter
+    auto camera_ray = [&](int x, int y, SampleStream & stream){
+        float u = ((float)(x) + stream.next()) / renderer.w;
+        float v = ((float)(y) + stream.next()) / renderer.h;
+        // this is a random uv that belongs to the pixel xy.
+        Vec3 dir = screen_space_to_worldSpace(view.inv_model_view.data(), view.inv_proj.data(), view.near_far_planes.data(), u,v) - pos;
+
+        dir.normalize();
+        return Ray(pos , dir);
+    };
+    auto accumulate = [](RayResult & acc, float & acc_luminance_sq, const RayResult & res){
+        acc.color += res.color;
+        acc.normal += res.normal;
+        acc.depth = std::min(acc.depth, res.depth);
+        float luminance = res.color.luminance();
+        acc_luminance_sq += luminance * luminance;
+    };
+    // into the renderer's sums, each pixel is only in one tile
+    auto store = [&](int p, const RayResult & acc, float acc_luminance_sq, unsigned int n_samples){
+        renderer.color_sum[p] += acc.color;
+        renderer.normal_sum[p] += acc.normal;
+        renderer.depth_min[p] = std::min(renderer.depth_min[p], acc.depth);
+        renderer.luminance_sq_sum[p] += acc_luminance_sq;
+        renderer.pixel_samples[p] += n_samples;
+    };
+
+    // pixels go by blocks of PACKET_SIDE x PACKET_SIDE, each sample of a block is traced as one packet
+    const int PACKET_SIDE = 4;
+    static_assert(PACKET_SIDE * PACKET_SIDE == PACKET_SIZE, "a block is one packet");
+
+    if (renderer.wavefront){
+        // every sample of the tile goes in the queue, still by blocks so the camera rays make coherent packets
+        std::vector< RayResult > acc(sizeX * sizeY);
+        std::vector< float > acc_luminance_sq(sizeX * sizeY, 0.0f);
+        std::vector< unsigned int > acc_samples(sizeX * sizeY, 0); // a cancelled tile stops between batches
+        std::vector< unsigned int > n_samples(sizeX * sizeY); // this pass's, 0 for inactive pixels, the ones close to maxSamples() get less
+        std::vector< Ray > rays;
+        std::vector< SampleStream > streams;
+        std::vector< unsigned int > ray_pixel; // in acc
+        std::vector< RayResult > results;
+        rays.reserve(wavefront::BATCH_SIZE);
+        streams.reserve(wavefront::BATCH_SIZE);
+        ray_pixel.reserve(wavefront::BATCH_SIZE);
+
+        auto flush = [&](){
+            wavefront::trace(scene, rays, streams, results, renderer.sort_secondary_rays);
+            for (size_t i = 0; i < rays.size(); ++i){
+                accumulate(acc[ray_pixel[i]], acc_luminance_sq[ray_pixel[i]], results[i]);
+                acc_samples[ray_pixel[i]]++;
+            }
+            rays.clear();
+            streams.clear();
+            ray_pixel.clear();
+        };
+
+        for (int y=pos_y; y<pos_y+sizeY; y++){
+            for (int x = pos_x; x<pos_x+sizeX; x++) {
+                int p = idx_from_coord(x, y, renderer.w);
+                n_samples[(x - pos_x) + (y - pos_y) * sizeX] = renderer.pixel_active[p] ? renderer.passSamples(p, context.samples) : 0;
+            }
+        }
 
-                float u = ((float)(x) + (float)(rng())/(float)(rng.max())) / renderer.w;
-                float v = ((float)(y) + (float)(rng())/(float)(rng.max())) / renderer.h;
-                // this is a random uv that belongs to the pixel xy.
-                dir = screen_space_to_worldSpace(inv_model_view.data(), inv_proj.data(), near_far_planes.data(), u,v) - pos;
-                
-                dir.normalize();
-                RayResult res = scene.rayTrace( Ray(pos , dir) );
-                acc.color += res.color;
-                acc.normal += res.normal;
-                acc.depth = std::min(acc.depth, res.depth);
+        for( unsigned int s = 0 ; s < context.samples && !context.cancelled ; ++s ) {
+            for (int block_y = pos_y; block_y < pos_y+sizeY; block_y += PACKET_SIDE){
+                for (int block_x = pos_x; block_x < pos_x+sizeX; block_x += PACKET_SIDE){
+                    for (int y = block_y; y < std::min(block_y + PACKET_SIDE, pos_y+sizeY); ++y){
+                        for (int x = block_x; x < std::min(block_x + PACKET_SIDE, pos_x+sizeX); ++x){
+                            int i = (x - pos_x) + (y - pos_y) * sizeX;
+                            if (s >= n_samples[i]) continue;
+                            int p = idx_from_coord(x, y, renderer.w);
+                            // numbered after the samples of the previous passes
+                            streams.emplace_back(context.sampler, p, renderer.sample_offset + renderer.pixel_samples[p] + s);
+                            rays.push_back(camera_ray(x, y, streams.back()));
+                            ray_pixel.push_back(i);
+                        }
+                    }
+                    if (rays.size() + PACKET_SIZE > wavefront::BATCH_SIZE) flush();
+                }
             }
+        }
+        flush();
 
-            
-            renderer.image[p] = Color(acc.color / renderer.nsamples);
-            renderer.screen_space_normals[p] = Color(acc.normal / renderer.nsamples);
-            renderer.screen_space_depth[p] = acc.depth;
+        for (int y=pos_y; y<pos_y+sizeY; y++){
+            for (int x = pos_x; x<pos_x+sizeX; x++) {
+                int i = (x - pos_x) + (y - pos_y) * sizeX;
+                store(idx_from_coord(x, y, renderer.w), acc[i], acc_luminance_sq[i], acc_samples[i]);
+            }
+        }
+    } else {
+        Ray rays[PACKET_SIZE];
+        RayResult results[PACKET_SIZE];
+        RayResult acc[PACKET_SIZE];
+        float acc_luminance_sq[PACKET_SIZE];
+        SampleStream streams[PACKET_SIZE];
+        int pixels[PACKET_SIZE]; // the block's active ones
+        unsigned int n_samples[PACKET_SIZE]; // this pass's, the pixels close to maxSamples() get less
+        int packet_pixels[PACKET_SIZE]; // in pixels, the ones that still take samples make the packet
+        for (int block_y = pos_y; block_y < pos_y+sizeY && !context.cancelled; block_y += PACKET_SIDE){
+            for (int block_x = pos_x; block_x < pos_x+sizeX && !context.cancelled; block_x += PACKET_SIDE){
+                int n = 0;
+                for (int y = block_y; y < std::min(block_y + PACKET_SIDE, pos_y+sizeY); ++y){
+                    for (int x = block_x; x < std::min(block_x + PACKET_SIDE, pos_x+sizeX); ++x){
+                        int p = idx_from_coord(x, y, renderer.w);
+                        if (renderer.pixel_active[p]) pixels[n++] = p;
+                    }
+                }
+                if (n == 0) continue;
+
+                unsigned int max_samples = 0;
+                for (int i = 0; i < n; ++i){
+                    acc[i] = RayResult();
+                    acc_luminance_sq[i] = 0.0f;
+                    n_samples[i] = renderer.passSamples(pixels[i], context.samples);
+                    max_samples = std::max(max_samples, n_samples[i]);
+                }
+
+                for( unsigned int s = 0 ; s < max_samples ; ++s ) {
+                    int m = 0;
+                    for (int i = 0; i < n; ++i){
+                        if (s >= n_samples[i]) continue;
+                        packet_pixels[m] = i;
+                        streams[m] = SampleStream(context.sampler, pixels[i], renderer.sample_offset + renderer.pixel_samples[pixels[i]] + s);
+                        rays[m] = camera_ray(pixels[i] % renderer.w, pixels[i] / renderer.w, streams[m]);
+                        m++;
+                    }
+
+                    scene.rayTracePacket(rays, m, results, streams);
+                    for (int j = 0; j < m; ++j) accumulate(acc[packet_pixels[j]], acc_luminance_sq[packet_pixels[j]], results[j]);
+                }
+
+                for (int i = 0; i < n; ++i) store(pixels[i], acc[i], acc_luminance_sq[i], n_samples[i]);
+            }
         }
     }
-    std::scoped_lock<std::mutex> lock(mtx);
-    ++count;
-    if (!renderer.silent) print_advancement();
+    context.progress.advance(sizeX * sizeY);
 }
 
-void ray_trace_from_camera_multithreaded(Renderer & renderer, const Scene & scene){
-    const unsigned int area_size = 30;
-    if (!renderer.silent) std::cout << "Number of cores:  \033[31m" << std::thread::hardware_concurrency() << "\033[36m"<< std::endl;
-
-    getInvModelView(inv_model_view.data());
-    getInvProj(inv_proj.data());
-    getNearAndFarPlanes(near_far_planes.data());
-    glMatrixMode (GL_MODELVIEW);
-    
-    int n_square_x = renderer.w / area_size;
-    int rest_x = renderer.w % area_size;
-
-    int n_square_y = renderer.h / area_size;
-    int rest_y = renderer.h % area_size;
+void ray_trace_from_camera_multithreaded(Renderer & renderer, const Scene & scene, const CameraView & view, unsigned int samples, bool verbose){
+    ThreadPool & pool = ThreadPool::shared();
+    if (verbose) std::cout << "Number of cores:  \033[31m" << pool.size() << "\033[36m"<< std::endl;
 
-    int n_threads = (n_square_x+1) * (n_square_y+1);
-    /*
-    std::cout << "nX: " << n_square_x << "   nY: " << n_square_y << std::endl;
-    std::cout << "rX: " << rest_x << "   rY: " << rest_y << std::endl;
-    */
+    RenderContext context(view, samples, Sampler(renderer.sampler_type, renderer.nsamples, renderer.w, renderer.frame), *renderer.cancel_requested, renderer.w * renderer.h, !verbose);
 
-    std::thread threads[n_threads];
+    TileScheduler scheduler(renderer.w, renderer.h, renderer.tile_size, renderer.tile_order, pool.size());
 
-    std::mutex threads_finished_count_mutex;
-
-    total_threads_n = n_threads;
-    count = 0;
-    if (!renderer.silent) print_advancement();
-
-    // full squares
-    for (int i = 0; i < n_square_x; i+=1){
-        for (int j = 0; j < n_square_y; j+=1){
-            
-            threads[idx_from_coord(i, j, n_square_x+1)] = std::thread(
-                ray_trace_square,
-                std::ref(renderer), std::cref(scene),
-                area_size * i, area_size * j, // pos of square (top left corner)
-                area_size, area_size, // size of square
-                std::ref(threads_finished_count_mutex)
-            );
-        }
-    }
-    
-    // bottom rest
-    int j_last = (n_square_y);
-    for (int i = 0; i < n_square_x; i+=1){
-
-        threads[idx_from_coord(i, j_last, n_square_x+1)] = std::thread(
-            ray_trace_square,
-            std::ref(renderer), std::cref(scene),
-            area_size * i, area_size * j_last, // pos of square (top left corner)
-            area_size, rest_y, // size of square
-            std::ref(threads_finished_count_mutex)
+    scheduler.run(pool, [&](const Tile & tile){
+        if (context.cancelled) return;
+        ray_trace_square(
+            renderer, scene, context,
+            tile.x, tile.y, // pos of square (top left corner)
+            tile.w, tile.h // size of square
         );
-
-    }
-    // right rest
-    int i_last = (n_square_x);
-    for (int j = 0; j < n_square_y; j+=1){
-
-        threads[idx_from_coord(i_last, j, n_square_x+1)] = std::thread(
-            ray_trace_square,
-            std::ref(renderer), std::cref(scene),
-            area_size * i_last, area_size * j, // pos of square (top left corner)
-            rest_x, area_size, // size of square
-            std::ref(threads_finished_count_mutex)
-        );
-    }
-
-    // very last, bottom right square
-    threads[idx_from_coord(i_last, j_last, n_square_x+1)] = std::thread(
-        ray_trace_square,
-        std::ref(renderer), std::cref(scene),
-        area_size * i_last, area_size * j_last, // pos of square (top left corner)
-        rest_x, rest_y, // size of square
-        std::ref(threads_finished_count_mutex)
-    );
-    
-    for (int t = 0; t < n_threads; ++t){
-        threads[t].join();
-    }
+    });
 }
 
 
@@ -220,26 +383,28 @@ void ray_trace_from_camera_singlethreaded(Renderer & renderer, const Scene & sce
     Vec3 pos , dir;
     RayResult acc;
     size_t p;
+    Sampler sampler(renderer.sampler_type, renderer.nsamples, renderer.w, renderer.frame);
     for (int y=0; y<renderer.h; y++){
         if (!renderer.silent) std::clog << "\r\tScanlines remaining: " << (renderer.h-y) << ' ' << std::flush;
         for (int x=0; x<renderer.w; x++) {
             acc = RayResult();
             p = idx_from_coord(x,y , renderer.w);
             for( unsigned int s = 0 ; s < renderer.nsamples ; ++s ) {
-                float u = ((float)(x) + (float)(rand())/(float)(RAND_MAX)) / renderer.w;
-                float v = ((float)(y) + (float)(rand())/(float)(RAND_MAX)) / renderer.h;
+                SampleStream stream(sampler, p, renderer.sample_offset + s);
+                float u = ((float)(x) + stream.next()) / renderer.w;
+                float v = ((float)(y) + stream.next()) / renderer.h;
                 // this is a random uv that belongs to the pixel xy.
                 screen_space_to_world_space_ray(u,v,pos,dir);
 
-                RayResult res = scene.rayTrace( Ray(pos , dir) );
+                RayResult res = scene.rayTrace( Ray(pos , dir), stream );
                 acc.color += res.color;
                 acc.normal += res.normal;
                 acc.depth = std::min(acc.depth, res.depth);
             }
 
             
-            renderer.image[p] = Color(acc.color / renderer.nsamples);
-            renderer.screen_space_normals[p] = Color(acc.normal / renderer.nsamples);
+            renderer.image.set(p, acc.color / renderer.nsamples);
+            renderer.screen_space_normals.set(p, acc.normal / renderer.nsamples);
             renderer.screen_space_depth[p] = acc.depth;
         }
     }
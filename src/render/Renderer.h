@@ -11,56 +11,157 @@
 #include <random>
 #include <memory>
 #include <mutex>
+#include <array>
+#include <atomic>
+#include <functional>
 #include "src/utils/Vec3.h"
 #include "src/render/Camera.h"
 #include "src/render/Scene.h"
 #include "src/utils/Color.h"
+#include "src/utils/FrameBuffer.h"
+#include "src/utils/ThreadPool.h"
+#include "TileScheduler.h"
+#include "Progress.h"
+#include "Sampler.h"
 
 #include "Postprocess.h"
 
 
+// the camera as the workers see it. Read from OpenGL's matrices, so on the thread that has the GL context,
+// then any thread can render with it
+struct CameraView {
+    std::array< GLdouble, 16 > inv_model_view, inv_proj;
+    std::array< GLdouble, 2 > near_far_planes;
+    Vec3 position;
+
+    static CameraView fromOpenGL();
+
+    bool operator==(const CameraView & other) const {
+        return inv_model_view == other.inv_model_view && inv_proj == other.inv_proj && near_far_planes == other.near_far_planes;
+    }
+    bool operator!=(const CameraView & other) const { return !(*this == other); }
+};
+
+// what the workers of one render share. Each render has its own, so renderers can trace at the same time
+struct RenderContext {
+    const CameraView & view;
+    unsigned int samples; // added to every pixel by this pass
+    Sampler sampler;
+    const std::atomic< bool > & cancelled;
+    Progress progress;
+
+    RenderContext(const CameraView & view, unsigned int samples, const Sampler & sampler, const std::atomic< bool > & cancelled, long n_pixels, bool silent)
+        : view(view), samples(samples), sampler(sampler), cancelled(cancelled), progress("Pixels", n_pixels, silent) {}
+};
 
 
 class Renderer{
 
-    friend void ray_trace_square(Renderer & renderer, const Scene & scene, int pos_x, int pos_y, int sizeX, int sizeY, std::mutex & mtx);
-    friend void ray_trace_from_camera_multithreaded(Renderer & renderer, const Scene & scene);
+    friend void ray_trace_square(Renderer & renderer, const Scene & scene, RenderContext & context, int pos_x, int pos_y, int sizeX, int sizeY);
+    friend void ray_trace_from_camera_multithreaded(Renderer & renderer, const Scene & scene, const CameraView & view, unsigned int samples, bool verbose);
     friend void ray_trace_from_camera_singlethreaded(Renderer & renderer, const Scene & scene);
 
     friend PostProcessEffect;
-    friend void postProcessSquare(Renderer & renderer, PostProcessEffect & posteffect, int pos_x, int pos_y, int sizeX, int sizeY, std::mutex & mtx); // needed in postprocess
+    friend void postProcessSquare(Renderer & renderer, PostProcessEffect & posteffect, int pos_x, int pos_y, int sizeX, int sizeY, Progress & progress); // needed in postprocess
 
 private:
 
 
-    std::vector< Color > image;
+    // linear, unclamped, see FrameBuffer
+    FrameBuffer image;
 
-    std::vector< Color > screen_space_normals;
+    FrameBuffer screen_space_normals;
 
     std::vector< float > screen_space_depth;
 
 
     std::vector< PostProcessEffect*> postProcessPipeline;
 
-    std::vector< Color > result_image;
+    FrameBuffer result_image;
 
-    std::vector< Color > workspace;
+    FrameBuffer workspace;
+
+    std::vector< Color > display_image; // result_image quantized, see getImage
     std::vector< int > test = {1, 2, 3};
 
+    // what the passes add up, image & co are their average
+    std::vector< Vec3 > color_sum;
+    std::vector< Vec3 > normal_sum;
+    std::vector< float > depth_min;
+    std::vector< unsigned int > pixel_samples; // per pixel, a cancelled pass stops anywhere
+    std::vector< float > luminance_sq_sum; // of every sample, for the variance
+
+    std::vector< unsigned char > pixel_active; // the ones the next pass traces, see updateActivePixels
+
+    // behind a pointer so the Renderer stays movable
+    std::unique_ptr< std::atomic< bool > > cancel_requested = std::make_unique< std::atomic< bool > >(false);
+
+    // image, screen_space_normals and screen_space_depth from the sums
+    void resolve();
+
+    // whether the 95% confidence interval of the pixel's mean luminance is within adaptive_threshold
+    bool converged(int p) const;
+
+    // marks the pixels that still need samples, returns how many there are. Without adaptive sampling, the ones
+    // under nsamples. With it, the ones under adaptive_min_samples, and the ones that haven't converged yet while
+    // the image's budget (nsamples on average) isn't spent
+    unsigned int updateActivePixels();
+
+    // the most samples a pixel gets: nsamples, or ADAPTIVE_MAX_FACTOR times that with adaptive sampling
+    unsigned int maxSamples() const { return adaptive_threshold > 0.0f ? ADAPTIVE_MAX_FACTOR * nsamples : nsamples; }
+
+    // what a pass of samples adds to pixel p: a cancelled pass leaves some pixels behind the others, none goes past maxSamples()
+    unsigned int passSamples(int p, unsigned int samples) const {
+        return std::min(samples, maxSamples() - std::min(maxSamples(), pixel_samples[p]));
+    }
+
+    // adds samples to every active pixel and resolves. False if cancelled
+    bool tracePass(const CameraView & view, const Scene & scene, unsigned int samples, bool verbose);
+
+    // result_image from image, through the post process pipeline
+    void finishImage(bool verbose);
+
 public:
     int w;
     int h;
 
     bool silent = false;
+
+    bool wavefront = false; // trace the tiles bounce by bounce (see Wavefront.h) instead of ray by ray
+    bool sort_secondary_rays = true; // wavefront only, reorder each bounce's rays so they're traced by coherent packets
+
+    int tile_size = 30; // in pixels, the scheduler still splits them when they're stolen
+    TileOrder tile_order = TileOrder_Scanline;
+
+    SamplerType sampler_type = SamplerType_Sobol; // for the pixels' jitter and the lights' samples
+
+    // Every random number is a function of (frame, pixel, sample index), see Sampler: the same settings give the
+    // same image whatever the number of threads. Processes rendering the same frame with sample_offset far enough
+    // apart draw different samples, their images can be averaged
+    unsigned int frame = 0;
+    unsigned int sample_offset = 0;
     
     unsigned int nsamples; 
 
+    // Adaptive sampling, off at 0. Pixels stop once the error on their luminance is under the threshold (in the
+    // image's 0-1 range), what they didn't use goes to the noisy ones, up to ADAPTIVE_MAX_FACTOR * nsamples each
+    float adaptive_threshold = 0.0f;
+    unsigned int adaptive_min_samples = 8; // before the variance is trusted, also the size of render()'s passes
+    static const unsigned int ADAPTIVE_MAX_FACTOR = 4;
+
     Renderer()
-        : image( 480*480 , Vec3(0,0,0) ),
-        screen_space_normals( 480*480 , Vec3(0,0,0) ),
+        : image( 480, 480 ),
+        screen_space_normals( 480, 480 ),
         screen_space_depth( 480*480, INFINITY ),
-        result_image( 480*480 , Vec3(0,0,0) ),
-        workspace( 480*480 , Vec3(0,0,0) ),
+        result_image( 480, 480 ),
+        workspace( 480, 480 ),
+
+        color_sum( 480*480 , Vec3(0,0,0) ),
+        normal_sum( 480*480 , Vec3(0,0,0) ),
+        depth_min( 480*480, 0.0f ),
+        pixel_samples( 480*480, 0 ),
+        luminance_sq_sum( 480*480, 0.0f ),
+        pixel_active( 480*480, 1 ),
 
         w(480),
         h(480),
@@ -68,11 +169,18 @@ public:
         {}
     
     Renderer(int width, int height, unsigned int samples_per_pixel)
-        : image( width*height , Vec3(0,0,0) ),
-        screen_space_normals( width*height , Vec3(0,0,0) ),
+        : image( width, height ),
+        screen_space_normals( width, height ),
         screen_space_depth( width*height, INFINITY ),
-        result_image( width*height , Vec3(0,0,0) ),
-        workspace( width*height , Vec3(0,0,0) ),
+        result_image( width, height ),
+        workspace( width, height ),
+
+        color_sum( width*height , Vec3(0,0,0) ),
+        normal_sum( width*height , Vec3(0,0,0) ),
+        depth_min( width*height, 0.0f ),
+        pixel_samples( width*height, 0 ),
+        luminance_sq_sum( width*height, 0.0f ),
+        pixel_active( width*height, 1 ),
 
         w(width),
         h(height),
@@ -80,12 +188,45 @@ public:
         {}
 
     void render(Camera & camera, const Scene & scene, bool export_after = true);
+
+    // same without OpenGL, callable from any thread. Renderers don't share anything, several can run at once
+    void render(const CameraView & view, const Scene & scene, bool export_after = true);
+
+    // Progressive rendering: passes add samples to what's accumulated, and the image is the average so far.
+    // Nothing is reset between passes, the caller does it when the view or the scene change
+
+    // also forgets about cancel()
+    void resetAccumulation();
+
+    // adds samples to every pixel that still needs some (none goes past maxSamples()), then resolves and post
+    // processes the image. False if cancelled on the way
+    bool renderPass(const CameraView & view, const Scene & scene, unsigned int samples);
+
+    // passes of samples_per_pass until no pixel needs samples anymore (every pixel has nsamples, or converged with
+    // adaptive sampling), time_budget seconds are spent (if > 0) or cancel()
+    // is called. on_pass is called after each one, with the number of samples accumulated so far.
+    // Starts from what's already accumulated, so calling it again resumes a render that ran out of time
+    void renderProgressive(const CameraView & view, const Scene & scene, unsigned int samples_per_pass, double time_budget = 0.0,
+        const std::function< void(unsigned int) > & on_pass = nullptr);
+
+    // samples every pixel has at least
+    unsigned int accumulatedSamples() const;
+
+    // from any thread, the current pass stops once its workers are done with the pixels they're on.
+    // The accumulation is abandoned: passes don't trace anything until resetAccumulation()
+    void cancel() { *cancel_requested = true; }
     
     void postProcess();
 
     void export_to_file(const std::string & filename = "./rendu.ppm");
 
-    std::vector< Color >& getImage(){ return result_image;}
+    // the result in 8 bits, the only place besides export_to_file where it's quantized
+    std::vector< Color >& getImage(){
+        result_image.toColors(display_image);
+        return display_image;
+    }
+
+    const FrameBuffer & getHDRImage() const { return result_image; }
     
     friend Renderer & operator<<(Renderer& renderer, PostProcessEffect* pp) {
         renderer.postProcessPipeline.push_back(
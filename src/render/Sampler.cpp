@@ -0,0 +1,270 @@
+#include "Sampler.h"
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include "src/utils/Random.h"
+
+
+namespace {
+
+// integer hash (Wellons' lowbias32), every input bit changes about half the output bits
+uint32_t hash(uint32_t x){
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t hashCombine(uint32_t seed, uint32_t v){
+    return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+uint32_t reverseBits(uint32_t x){
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of reverseBits(x), from the least significant one up: each bit only depends on the
+// ones below it (Burley 2020, after Laine and Karras). Working on reversed bits saves reversing them back and forth
+uint32_t reversedOwenScramble(uint32_t x, uint32_t seed){
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// i's place in a random permutation of [0, l[ picked by p (Kensler 2013)
+uint32_t permute(uint32_t i, uint32_t l, uint32_t p){
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893du;
+        i ^= p >> 16; i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3fu;
+        i ^= p >> 23; i ^= (i & w) >> 1;
+        i *= 1 | p >> 27; i *= 0x6935fa69u;
+        i ^= (i & w) >> 11; i *= 0x74dcb303u;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+
+// direction numbers of the first Sobol dimensions, the first is van der Corput's and the others are
+// built from Joe and Kuo's primitive polynomials (degree s, coefficients a, initial numbers m)
+struct SobolDirections {
+    std::array< std::array< uint32_t, 32 >, Sampler::GROUP_SIZE > v;
+    std::array< std::array< uint32_t, 32 >, Sampler::GROUP_SIZE > reversed_v;
+
+    SobolDirections(){
+        for (int i = 0; i < 32; ++i) v[0][i] = 1u << (31 - i);
+
+        struct Polynomial { int s; uint32_t a; uint32_t m[3]; };
+        const Polynomial polynomials[Sampler::GROUP_SIZE - 1] = {
+            {1, 0, {1}},
+            {2, 1, {1, 3}},
+            {3, 1, {1, 3, 1}}
+        };
+        for (unsigned int d = 1; d < Sampler::GROUP_SIZE; ++d){
+            const Polynomial & poly = polynomials[d - 1];
+            for (int i = 0; i < poly.s; ++i) v[d][i] = poly.m[i] << (31 - i);
+            for (int i = poly.s; i < 32; ++i){
+                v[d][i] = v[d][i - poly.s] ^ (v[d][i - poly.s] >> poly.s);
+                for (int k = 1; k < poly.s; ++k){
+                    if (poly.a >> (poly.s - 1 - k) & 1) v[d][i] ^= v[d][i - k];
+                }
+            }
+        }
+        for (unsigned int d = 0; d < Sampler::GROUP_SIZE; ++d){
+            for (int i = 0; i < 32; ++i) reversed_v[d][i] = reverseBits(v[d][i]);
+        }
+    }
+
+    // the point's bits reversed, from the index's bits reversed.
+    // The scrambled indices' bits are random, a branch per bit would be mispredicted half the time
+    uint32_t reversedPoint(uint32_t reversed_index, int dimension) const {
+        uint32_t x = 0;
+        for (int i = 0; i < 32; ++i) x ^= reversed_v[dimension][i] & (0u - (reversed_index >> (31 - i) & 1));
+        return x;
+    }
+};
+
+
+// BLUE_NOISE_SIZE x BLUE_NOISE_SIZE ranks in [0, 1[ by void and cluster (Ulichney 1993): every threshold of the
+// mask gives evenly spread points, with no low frequencies. Made once, the first time it's needed
+const int BLUE_NOISE_SIZE = 64;
+
+std::vector< float > makeBlueNoiseMask(){
+    const int size = BLUE_NOISE_SIZE;
+    const int n = size * size;
+    const float sigma = 1.5f;
+
+    // the gaussian energy of a point on the others, by wrapped distance
+    std::vector< float > kernel(n);
+    for (int dy = 0; dy < size; ++dy){
+        for (int dx = 0; dx < size; ++dx){
+            float x = std::min(dx, size - dx);
+            float y = std::min(dy, size - dy);
+            kernel[dx + dy * size] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector< float > energy(n, 0.0f);
+    std::vector< bool > on(n, false);
+    auto toggle = [&](int p){
+        on[p] = !on[p];
+        float sign = on[p] ? 1.0f : -1.0f;
+        int px = p % size;
+        int py = p / size;
+        for (int y = 0; y < size; ++y){
+            const float * row = &kernel[((y - py + size) % size) * size];
+            for (int x = 0; x < size; ++x) energy[x + y * size] += sign * row[(x - px + size) % size];
+        }
+    };
+    // tightest cluster: the point with the most energy. Largest void: the empty spot with the least
+    auto extremum = [&](bool of_on, bool largest){
+        int best = -1;
+        for (int p = 0; p < n; ++p){
+            if (on[p] != of_on) continue;
+            if (best < 0 || (largest ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // a tenth of the points at random, then moved from the clusters to the voids until they're even
+    int n_initial = 0;
+    for (uint32_t i = 0; n_initial < n / 10; ++i){
+        int p = hash(i) % n;
+        if (on[p]) continue;
+        toggle(p);
+        n_initial++;
+    }
+    for (int i = 0; i < n; ++i){ // converges long before
+        int cluster = extremum(true, true);
+        toggle(cluster);
+        int hole = extremum(false, false);
+        toggle(hole);
+        if (hole == cluster) break;
+    }
+    std::vector< bool > initial = on;
+    std::vector< float > initial_energy = energy;
+
+    std::vector< float > rank(n);
+    // the initial points' ranks, removing them from the tightest clusters first
+    for (int r = n_initial - 1; r >= 0; --r){
+        int cluster = extremum(true, true);
+        toggle(cluster);
+        rank[cluster] = r;
+    }
+    // the others', filling the largest voids first
+    on = initial;
+    energy = initial_energy;
+    for (int r = n_initial; r < n; ++r){
+        int hole = extremum(false, false);
+        toggle(hole);
+        rank[hole] = r;
+    }
+
+    for (float & r: rank) r = (r + 0.5f) / n;
+    return rank;
+}
+
+}
+
+
+float Sampler::threadLocal(){
+    static std::atomic< uint64_t > next_stream{0};
+    static thread_local Pcg32 rng(0x853c49e6748fea9bull, next_stream++);
+    return rng.nextFloat();
+}
+
+
+uint32_t Sampler::pixelSeed(uint32_t pixel) const {
+    return hashCombine(hash(pixel), frame);
+}
+
+
+void Sampler::independent(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const {
+    std::array< uint32_t, 4 > words = philox4x32({group, sample, 0, 0}, {pixel, frame});
+    for (uint32_t d = 0; d < GROUP_SIZE; ++d) values[d] = toUnitFloat(words[d]);
+}
+
+
+void Sampler::stratified(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const {
+    // past samples_per_pixel samples (adaptive sampling), another round of the strata in another order
+    uint32_t round = sample / samples_per_pixel;
+    for (uint32_t d = 0; d < GROUP_SIZE; ++d){
+        uint32_t seed = hashCombine(hashCombine(pixelSeed(pixel), group * GROUP_SIZE + d), round);
+        uint32_t stratum = permute(sample % samples_per_pixel, samples_per_pixel, seed);
+        float jitter = toUnitFloat(hashCombine(seed, sample));
+        values[d] = std::min((stratum + jitter) / samples_per_pixel, 0.99999994f);
+    }
+}
+
+
+void Sampler::sobol(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const {
+    static const SobolDirections directions;
+
+    // past the first GROUP_SIZE dimensions the same points are used again, in another order and scrambled differently:
+    // each group is well distributed by itself, and independent from the others
+    uint32_t group_seed = hashCombine(pixelSeed(pixel), group);
+    uint32_t reversed_index = reversedOwenScramble(reverseBits(sample), group_seed); // shuffled
+    for (uint32_t d = 0; d < GROUP_SIZE; ++d){
+        uint32_t x = directions.reversedPoint(reversed_index, d);
+        values[d] = toUnitFloat(reverseBits(reversedOwenScramble(x, hashCombine(group_seed, d))));
+    }
+}
+
+
+void Sampler::blueNoise(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const {
+    static const std::vector< float > mask = makeBlueNoiseMask();
+    // 2^32 / p^(d + 1) with p^5 = p + 1, the R4 sequence (Roberts 2018): each dimension of a group moves by its own
+    // irrational step, so a pixel's samples spread over the whole group and not along a diagonal
+    static const uint32_t STEPS[GROUP_SIZE] = {0xdb4f0b91u, 0xbbe05633u, 0xa0f2ec76u, 0x89e18285u};
+
+    // neighbouring pixels get values far apart in every dimension, they all move by the same steps. The sample index
+    // is shuffled per group so the groups don't move together either, an aligned block of 2^k samples stays a block
+    uint32_t group_seed = hashCombine(hash(group), frame);
+    uint32_t index = reverseBits(reversedOwenScramble(reverseBits(sample), group_seed));
+    for (uint32_t d = 0; d < GROUP_SIZE; ++d){
+        uint32_t offset = hashCombine(hash(group * GROUP_SIZE + d), frame);
+        int x = (pixel % width + offset) % BLUE_NOISE_SIZE;
+        int y = (pixel / width + (offset >> 16)) % BLUE_NOISE_SIZE;
+        float v = mask[x + y * BLUE_NOISE_SIZE] + toUnitFloat(index * STEPS[d]);
+        values[d] = std::min(v - std::floor(v), 0.99999994f);
+    }
+}
+
+
+void Sampler::getGroup(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const {
+    switch (type){
+        case SamplerType_Independent: independent(pixel, sample, group, values); return;
+        case SamplerType_Stratified: stratified(pixel, sample, group, values); return;
+        case SamplerType_Sobol: sobol(pixel, sample, group, values); return;
+        case SamplerType_BlueNoise: blueNoise(pixel, sample, group, values); return;
+    }
+}
+
+
+float Sampler::get(uint32_t pixel, uint32_t sample, uint32_t dimension) const {
+    float values[GROUP_SIZE];
+    getGroup(pixel, sample, dimension / GROUP_SIZE, values);
+    return values[dimension % GROUP_SIZE];
+}
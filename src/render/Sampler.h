@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+
+// Where the renderer's random numbers come from. A value is identified by the pixel, the index of the sample in
+// that pixel (counted over every pass, so progressive and adaptive renders carry on the same sequence) and the
+// dimension, the how-many-th number the sample's path draws. The same (frame, pixel, sample, dimension) always gives
+// the same value, whatever thread, pass or process traces it, so renders are reproducible bit for bit.
+enum SamplerType {
+    SamplerType_Independent,    // uniform random numbers, no structure at all (Philox, counter based)
+    SamplerType_Stratified,     // every dimension cut in samples_per_pixel strata, shuffled per pixel and dimension
+    SamplerType_Sobol,          // Owen scrambled Sobol points, in groups of 4 dimensions (Burley 2020)
+    SamplerType_BlueNoise       // a blue noise mask shifted per dimension, moved along the R4 sequence per sample
+};
+
+class Sampler {
+    SamplerType type;
+    unsigned int samples_per_pixel; // the strata
+    int width;                      // the pixel's x and y, for the blue noise mask
+    uint32_t frame;                 // another frame, other numbers
+
+    uint32_t pixelSeed(uint32_t pixel) const;
+
+    // the GROUP_SIZE values of a group of dimensions at once, they share most of the work
+    void independent(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const;
+    void stratified(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const;
+    void sobol(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const;
+    void blueNoise(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const;
+
+public:
+    // dimensions are used by groups of this many, a 2D or 3D value is taken from a single group
+    static const uint32_t GROUP_SIZE = 4;
+
+    Sampler(SamplerType type, unsigned int samples_per_pixel, int width, uint32_t frame = 0)
+        : type(type), samples_per_pixel(samples_per_pixel > 0 ? samples_per_pixel : 1), width(width), frame(frame) {}
+
+    // in [0, 1[
+    float get(uint32_t pixel, uint32_t sample, uint32_t dimension) const;
+
+    // dimensions group * GROUP_SIZE to (group + 1) * GROUP_SIZE - 1 in values
+    void getGroup(uint32_t pixel, uint32_t sample, uint32_t group, float * values) const;
+
+    // in [0, 1[, from a PCG32 per thread. For what isn't a pixel's sample (debug drawing, a lone rayTrace)
+    static float threadLocal();
+};
+
+
+// the numbers one path draws, one dimension after the other. A group of dimensions is generated when its first
+// one is drawn, the others are kept for the next draws
+struct SampleStream {
+    const Sampler * sampler = nullptr; // Sampler::threadLocal without one
+    uint32_t pixel = 0;
+    uint32_t sample = 0;
+    uint32_t dimension = 0;
+
+    uint32_t cached_group = UINT32_MAX;
+    float cached_values[Sampler::GROUP_SIZE];
+
+    SampleStream() = default;
+    SampleStream(const Sampler & sampler, uint32_t pixel, uint32_t sample) : sampler(&sampler), pixel(pixel), sample(sample) {}
+
+    float next(){
+        if (!sampler) return Sampler::threadLocal();
+        uint32_t group = dimension / Sampler::GROUP_SIZE;
+        if (group != cached_group){
+            sampler->getGroup(pixel, sample, group, cached_values);
+            cached_group = group;
+        }
+        return cached_values[dimension++ % Sampler::GROUP_SIZE];
+    }
+
+    // the next values start a new group of dimensions
+    void startGroup(){
+        dimension = (dimension + Sampler::GROUP_SIZE - 1) / Sampler::GROUP_SIZE * Sampler::GROUP_SIZE;
+    }
+};
@@ -5,8 +5,11 @@
 #include "src/mesh/Mesh.h"
 #include "src/mesh/Sphere.h"
 #include "src/mesh/Square.h"
+#include "src/mesh/MeshInstance.h"
 #include <random>
+#include "src/render/RaySceneIntersection.h"
 #include "src/render/KDTree.h"
+#include "src/render/BVH.h"
 
 #include <GL/glut.h>
 
@@ -22,62 +25,6 @@ struct RayResult {
 // struct light defined in Material
 
 
-enum INTERSECTION_TYPE {
-    INTERSECTION_MESH,
-    INTERSECTION_SPHERE,
-    INTERSECTION_SQUARE,
-    INTERSECTION_LIGHT
-};
-
-class RaySceneIntersection{
-    public:
-        bool intersectionExists;
-        unsigned int typeOfIntersectedObject;
-        unsigned int objectIndex;
-        float t;
-
-        RayTriangleIntersection rayMeshIntersection;
-        RaySphereIntersection raySphereIntersection;
-        RaySquareIntersection raySquareIntersection;
-
-        RaySceneIntersection() : intersectionExists(false) , t(FLT_MAX) {}
-
-        const Vec3& get_normal() const{
-            switch (typeOfIntersectedObject){
-                case INTERSECTION_MESH:
-                    return rayMeshIntersection.normal;
-                case INTERSECTION_SPHERE:
-                    return raySphereIntersection.normal;
-                case INTERSECTION_SQUARE:
-                    return raySquareIntersection.normal;
-            }
-        }
-
-        const Vec3& get_position() const{
-            switch (typeOfIntersectedObject){
-                case INTERSECTION_MESH:
-                    return rayMeshIntersection.intersection;
-                case INTERSECTION_SPHERE:
-                    return raySphereIntersection.intersection;
-                case INTERSECTION_SQUARE:
-                    return raySquareIntersection.intersection;
-            }
-        }
-        const Vec2& get_uv() const{
-            switch (typeOfIntersectedObject){
-                case INTERSECTION_MESH:
-                    return rayMeshIntersection.uv;
-                case INTERSECTION_SPHERE:
-                    return raySphereIntersection.uv;
-                case INTERSECTION_SQUARE:
-                    return raySquareIntersection.uv;
-            }
-        }
-
-};
-
-
-
 class Scene {
 public:
     std::vector< std::shared_ptr< Material > > materials;
@@ -86,8 +33,12 @@ public:
     std::vector< Square > squares;
     std::vector< Light > lights;
 
-    bool useKdTree = false;
-    KDTree kdTree;
+    // meshes that are only drawn through instances, in their own object space
+    std::vector< Mesh > prototypes;
+    std::vector< MeshInstance > instances;
+
+    // nullptr: linear loops, each mesh tests its own AABB. Depending on the structure, spheres, squares and instances may still be looped over
+    std::unique_ptr< AccelerationStructure > accelerationStructure;
 
     std::string name = "unnamed scene";
 
@@ -96,16 +47,35 @@ public:
         return materials.size()-1;
     }
 
+    int addPrototype(const Mesh & m){
+        prototypes.push_back(m);
+        return prototypes.size()-1;
+    }
+
     const Material & getMaterial(int i) const {
         return *materials[i];
     }
 
     Scene() = default;
 
-    void generateKdTree(){
+    // call it last, once every object is in the scene: the BVH references the spheres and squares
+    void generateAccelerationStructure(AccelerationType type = AccelerationType_BVH){
+        accelerationStructure.reset(); // an empty scene has none, not the previous one
+        switch (type){
+            case AccelerationType_KdTree:
+                if (!meshes.empty()) accelerationStructure = std::make_unique< KDTree >(meshes);
+                break;
+            case AccelerationType_BVH:
+                if (!meshes.empty() || !spheres.empty() || !squares.empty() || !instances.empty())
+                    accelerationStructure = std::make_unique< BVH >(meshes, spheres, squares, prototypes, instances, materials);
+                break;
+        }
+    }
+
+    void generateKdTree(KDTree::BuildMode mode = KDTree::BuildMode_SAH){
+        accelerationStructure.reset();
         if (!meshes.empty()){
-            useKdTree = true;
-            kdTree = KDTree(meshes);
+            accelerationStructure = std::make_unique< KDTree >(meshes, mode);
         }
     }
 
@@ -113,6 +83,7 @@ public:
 
         int tri_count = 0;
         for (const Mesh & mesh:meshes) tri_count += mesh.triangles.size();
+        for (const MeshInstance & instance:instances) tri_count += prototypes[instance.prototype].triangles.size();
 
         if (remove_old){
 
@@ -128,8 +99,8 @@ public:
 \n\t\033[36mMesh mode: \033[31m%s\n\
 \n\033[36m###--------%s###\033[0m\n",
             name.c_str(),
-            spheres.size(), squares.size(), meshes.size(), tri_count, lights.size(),
-            useKdTree ? "Scene-wide KdTree" : "AABB",
+            spheres.size(), squares.size(), meshes.size() + instances.size(), tri_count, lights.size(),
+            accelerationStructure ? accelerationStructure->name() : "AABB",
             std::string(name.size(), '-').c_str()
             );
     }
@@ -144,6 +115,10 @@ public:
             Sphere const & sphere = spheres[It];
             sphere.draw(getMaterial(sphere.material_id));
         }
+        for( unsigned int It = 0 ; It < instances.size() ; ++It ) {
+            MeshInstance const & instance = instances[It];
+            instance.draw(prototypes[instance.prototype], getMaterial(instance.material_id));
+        }
         for( unsigned int It = 0 ; It < squares.size() ; ++It ) {
             Square const & square = squares[It];
             square.draw(getMaterial(square.material_id));
@@ -155,16 +130,19 @@ public:
         }
     }
 
-    const Mesh & getObject(int type, int idx) const {
+    int getMaterialId(int type, int idx) const {
 
         switch (type){
-            case 0:
-                return meshes[idx];
-            case 1:
-                return spheres[idx];
-            case 2:
-                return squares[idx];
+            case INTERSECTION_MESH:
+                return meshes[idx].material_id;
+            case INTERSECTION_SPHERE:
+                return spheres[idx].material_id;
+            case INTERSECTION_SQUARE:
+                return squares[idx].material_id;
+            case INTERSECTION_INSTANCE:
+                return instances[idx].material_id;
         }
+        return 0;
     } 
 
 
@@ -172,8 +150,31 @@ public:
         RaySceneIntersection result;
         result.intersectionExists = false;
 
+        if (accelerationStructure){
+            result = accelerationStructure->getIntersection(ray);
+            if (accelerationStructure->coversWholeScene()) return result;
+        }
+
+        intersectOutsideAcceleration(ray, result);
+        return result;
+    }
 
-        float min_dist = std::numeric_limits<float>::infinity();
+    // computeIntersection for n <= PACKET_SIZE rays
+    void computeIntersections(const Ray * rays, int n, RaySceneIntersection * results) const {
+        if (!accelerationStructure){
+            for (int i = 0; i < n; ++i) results[i] = computeIntersection(rays[i]);
+            return;
+        }
+
+        accelerationStructure->getIntersections(rays, n, results);
+        if (accelerationStructure->coversWholeScene()) return;
+
+        for (int i = 0; i < n; ++i) intersectOutsideAcceleration(rays[i], results[i]);
+    }
+
+    // what the acceleration structure (if any) doesn't hold, result is only updated by closer hits
+    void intersectOutsideAcceleration(Ray const & ray, RaySceneIntersection & result) const {
+        float min_dist = result.t;
 
         // Spheres 
         for (int i = 0; i<spheres.size(); ++i){
@@ -210,7 +211,7 @@ public:
         
         // Meshes 
 
-        if (!useKdTree){
+        if (!accelerationStructure){
             for (int i = 0; i<meshes.size(); ++i){
 
                 RayTriangleIntersection intersection = meshes[i].intersect(ray);
@@ -227,23 +228,23 @@ public:
                     
                 }
             }
-        } else {
-            KDTree::KdIntersectionResult intersection = kdTree.getIntersection(ray);
-            if (intersection.triangleIntersection.intersectionExists &&
-                intersection.triangleIntersection.t < min_dist  &&
-                intersection.triangleIntersection.t >= MIN_OFFSET_VALUE)
-                {
+        }
+        // Instances 
+        for (size_t i = 0; i<instances.size(); ++i){
 
-                    result.intersectionExists = true;
+            RayTriangleIntersection intersection = instances[i].intersect(ray, prototypes[instances[i].prototype]);
 
-                    result.t = intersection.triangleIntersection.t;
-                    //min_dist = intersection.triangleIntersection.t;
-                    result.rayMeshIntersection = intersection.triangleIntersection;
-                    result.typeOfIntersectedObject = INTERSECTION_MESH;
-                    result.objectIndex = intersection.meshIndex;
-                }
+            if (intersection.intersectionExists && intersection.t < min_dist  && intersection.t >= MIN_OFFSET_VALUE){
+
+                result.intersectionExists = true;
+
+                result.t = intersection.t;
+                min_dist = intersection.t;
+                result.rayMeshIntersection = intersection;
+                result.typeOfIntersectedObject = INTERSECTION_INSTANCE;
+                result.objectIndex = i;
+            }
         }
-        return result;
     }
 
 
@@ -251,7 +252,12 @@ public:
     bool computeOcclusion(Ray const & ray, const Light & light) const { // TODO how to compute for transparent objects?
 
         float dist_to_light = (light.pos - ray.origin()).norm();
-        float power = 1.0;
+
+        if (accelerationStructure){
+            if (accelerationStructure->hasIntersection(ray, dist_to_light)) return true;
+            if (accelerationStructure->coversWholeScene()) return false;
+        }
+
         // Spheres 
         for (int i = 0; i<spheres.size(); ++i){
             
@@ -279,19 +285,7 @@ public:
             }
         }
         // meshes 
-        for (int i = 0; i<squares.size(); ++i){
-
-            if (! getMaterial(squares[i].material_id).casts_shadows ) continue;
-            RaySquareIntersection intersection = squares[i].intersect(ray);
-
-            if (intersection.intersectionExists &&
-                intersection.t >= MIN_OFFSET_VALUE &&
-                intersection.t < dist_to_light
-                ){
-                return true;
-            }
-        }
-        if (!useKdTree){
+        if (!accelerationStructure){
             for (int i = 0; i<meshes.size(); ++i){
 
                 RayTriangleIntersection intersection = meshes[i].intersect(ray);
@@ -303,28 +297,29 @@ public:
                     return true;
                 }
             }
-        } else {
-            /*
-            KDTree::KdIntersectionResult intersection = kdTree.getIntersection(ray);
-            if (intersection.triangleIntersection.intersectionExists &&
-                intersection.triangleIntersection.t >= MIN_OFFSET_VALUE &&
-                intersection.triangleIntersection.t < dist_to_light
-                ){
-                    return true;
-                }
-            */
-           if (kdTree.hasIntersection(ray, dist_to_light)) return true;
+        }
+        // instances 
+        for (size_t i = 0; i<instances.size(); ++i){
+
+            RayTriangleIntersection intersection = instances[i].intersect(ray, prototypes[instances[i].prototype]);
+
+            if (intersection.intersectionExists &&
+            intersection.t >= MIN_OFFSET_VALUE &&
+            intersection.t < dist_to_light
+            ){
+                return true;
+            }
         }
         return false;
     }
     const int N_OCCLUSION_RAYS = 8;
 
-    void traceOcclusionRays(const Vec3 position, std::vector<float> & res) const {
+    void traceOcclusionRays(const Vec3 position, std::vector<float> & res, SampleStream & stream) const {
         for (int l_idx = 0; l_idx < lights.size(); l_idx++){
             const Light & l = lights[l_idx];
             for (int i = 0; i < N_OCCLUSION_RAYS; ++i){
 
-                Vec3 to = l.getRandomTarget() - position;
+                Vec3 to = l.getRandomTarget(stream) - position;
                 if (!computeOcclusion(
                     Ray(position,to /*no need to normalize*/),
                     l
@@ -335,18 +330,18 @@ public:
         }
     }
 
-    void rayTraceRecursive( Ray const & ray , RayResult & res, int NRemainingBounces, bool update_depth = true, bool update_normal = true ) const {
+    void rayTraceRecursive( Ray const & ray , RayResult & res, SampleStream & stream, int NRemainingBounces, bool update_depth = true, bool update_normal = true ) const {
         if (NRemainingBounces == 0){
             return;
         }
-        RaySceneIntersection raySceneIntersection = computeIntersection(ray);
-        
-        if (!raySceneIntersection.intersectionExists){ // if no collision
+        shadeIntersection(ray, computeIntersection(ray), res, stream, NRemainingBounces, update_depth, update_normal);
+    }
 
-            // sky
-            float a = 0.5*(ray.direction()[1] + 1.0);
+    // everything rayTraceRecursive does once the ray's hit is known
+    void shadeIntersection( Ray const & ray, RaySceneIntersection const & raySceneIntersection, RayResult & res, SampleStream & stream, int NRemainingBounces, bool update_depth, bool update_normal ) const {
+        if (!raySceneIntersection.intersectionExists){ // if no collision
 
-            res.color = (1.0-a)*Vec3(1.0, 1.0, 1.0) + a*Vec3(0.5, 0.7, 1.0);
+            res.color = skyColor(ray);
             if (update_depth) res.depth = -1;
             return ;
             
@@ -354,16 +349,14 @@ public:
 
         //if collision
 
-        Vec3 env_contrib(0, 0, 0);
-        const Mesh &mesh = getObject(
+        const Material& mat = getMaterial(getMaterialId(
             raySceneIntersection.typeOfIntersectedObject,
             raySceneIntersection.objectIndex
-            );
-        const Material& mat = getMaterial(mesh.material_id);
+            ));
 
         std::vector<float> lights_contrib(lights.size(), 0.0);
 
-        traceOcclusionRays(raySceneIntersection.get_position(), lights_contrib);
+        Vec3 color = hitColor(ray, raySceneIntersection, mat, lights_contrib, stream);
 
         if (update_depth) res.depth += raySceneIntersection.t;
         if (update_normal) res.normal = raySceneIntersection.get_normal();
@@ -380,11 +373,12 @@ public:
                     scatter_direction
                 ),
                 res,
+                stream,
                 NRemainingBounces-1,
                 update_depth,
                 update_normal
             );
-        res.color += mat.computeColor(LightingData(raySceneIntersection.get_position(), raySceneIntersection.get_normal(), raySceneIntersection.get_uv(), ray.direction(), env_contrib, lights, lights_contrib));
+        res.color += color;
 
 
 
@@ -392,18 +386,51 @@ public:
         std::cout << "\t INTERSECTION \n\t\tpos=(" << raySceneIntersection.get_position() << ")\n\t\tnormal = ("<<raySceneIntersection.get_normal()<< ")" << std::endl;
         std::cout << "\t\t incident ray: " << ray.direction() << std::endl;
         std::cout << "\t\t reflected ray: " << res << std::endl;
-        std::cout << "\n\t\t env_contrib: " << env_contrib << std::endl;
         std::cout << "\n\t\t mat_color: " << mat.diffuse_color << std::endl;
         */
     }
 
-    RayResult rayTrace( Ray const & rayStart ) const {
+    Vec3 skyColor( Ray const & ray ) const {
+        float a = 0.5*(ray.direction()[1] + 1.0);
+        return (1.0-a)*Vec3(1.0, 1.0, 1.0) + a*Vec3(0.5, 0.7, 1.0);
+    }
+
+    // what a hit adds by itself to its path's color, whatever its scattered ray finds: the lights it sees through
+    // the occlusion rays, lit by its material. lights_contrib is only a buffer, one float per light.
+    // The occlusion rays' targets are drawn from the path's stream
+    Vec3 hitColor( Ray const & ray, RaySceneIntersection const & raySceneIntersection, const Material & mat, std::vector<float> & lights_contrib, SampleStream & stream ) const {
+        Vec3 env_contrib(0, 0, 0);
+
+        std::fill(lights_contrib.begin(), lights_contrib.end(), 0.0f);
+        traceOcclusionRays(raySceneIntersection.get_position(), lights_contrib, stream);
+
+        return mat.computeColor(LightingData(raySceneIntersection.get_position(), raySceneIntersection.get_normal(), raySceneIntersection.get_uv(), ray.direction(), env_contrib, lights, lights_contrib));
+    }
+
+    // the path's random numbers come from stream
+    RayResult rayTrace( Ray const & rayStart, SampleStream & stream ) const {
 
         RayResult v; // struct defined in renderer.h
 
-        rayTraceRecursive(rayStart, v, 100, true, true );
+        rayTraceRecursive(rayStart, v, stream, 100, true, true );
 
         return v;
     }
 
+    // with independent random numbers
+    RayResult rayTrace( Ray const & rayStart ) const {
+        SampleStream stream;
+        return rayTrace(rayStart, stream);
+    }
+
+    // rayTrace for n <= PACKET_SIZE coherent rays (camera rays): their first hits are searched together, the bounces one ray at a time
+    void rayTracePacket( const Ray * rays, int n, RayResult * results, SampleStream * streams ) const {
+        RaySceneIntersection hits[PACKET_SIZE];
+        computeIntersections(rays, n, hits);
+        for (int i = 0; i < n; ++i){
+            results[i] = RayResult();
+            shadeIntersection(rays[i], hits[i], results[i], streams[i], 100, true, true);
+        }
+    }
+
 };
\ No newline at end of file
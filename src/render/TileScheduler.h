@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include "src/utils/ThreadPool.h"
+
+
+// a rectangle of pixels, one task for the workers
+struct Tile {
+    int x, y; // top left corner
+    int w, h;
+};
+
+// size x size squares, and the thinner ones left on the right and bottom sides
+inline std::vector< Tile > splitInTiles(int w, int h, int size){
+    std::vector< Tile > tiles;
+    for (int y = 0; y < h; y += size){
+        for (int x = 0; x < w; x += size){
+            tiles.push_back({x, y, std::min(size, w - x), std::min(size, h - y)});
+        }
+    }
+    return tiles;
+}
+
+
+// the order tiles are started in
+enum TileOrder {
+    TileOrder_Scanline,     // rows, top to bottom
+    TileOrder_Morton,       // Z curve, neighbours are started together
+    TileOrder_CenterOut     // closest to the middle of the image first, where the subject usually is
+};
+
+
+// Tiles dealt to one deque per worker in the chosen order. A worker takes its next tile from the front of its own
+// deque, and once it's empty steals from the back of the others' (the tiles their owner would have done last).
+// A stolen tile is cut in two first if it's still big enough, the thief keeps the other half for later: the end of
+// a render is done with small tiles and the few threads stuck on the expensive ones (glass, mirrors) are helped.
+class TileScheduler {
+    struct WorkerQueue {
+        std::mutex mtx;
+        std::deque< Tile > tiles;
+    };
+
+    std::vector< std::unique_ptr< WorkerQueue > > queues;
+    int min_split_size;
+
+    static uint32_t morton(uint32_t x, uint32_t y){
+        uint32_t code = 0;
+        for (int bit = 0; bit < 16; ++bit) code |= (x >> bit & 1) << (2 * bit) | (y >> bit & 1) << (2 * bit + 1);
+        return code;
+    }
+
+    static void order(std::vector< Tile > & tiles, TileOrder tile_order, int image_w, int image_h, int tile_size){
+        switch (tile_order){
+            case TileOrder_Scanline:
+                break; // already, see splitInTiles
+            case TileOrder_Morton:
+                std::stable_sort(tiles.begin(), tiles.end(), [tile_size](const Tile & a, const Tile & b){
+                    return morton(a.x / tile_size, a.y / tile_size) < morton(b.x / tile_size, b.y / tile_size);
+                });
+                break;
+            case TileOrder_CenterOut: {
+                auto dist = [image_w, image_h](const Tile & t){
+                    float dx = t.x + t.w * 0.5f - image_w * 0.5f;
+                    float dy = t.y + t.h * 0.5f - image_h * 0.5f;
+                    return dx * dx + dy * dy;
+                };
+                std::stable_sort(tiles.begin(), tiles.end(), [&dist](const Tile & a, const Tile & b){ return dist(a) < dist(b); });
+                break;
+            }
+        }
+    }
+
+    bool pop(unsigned int worker, Tile & tile){
+        WorkerQueue & q = *queues[worker];
+        std::scoped_lock< std::mutex > lock(q.mtx);
+        if (q.tiles.empty()) return false;
+        tile = q.tiles.front();
+        q.tiles.pop_front();
+        return true;
+    }
+
+    bool steal(unsigned int thief, Tile & tile){
+        for (unsigned int i = 1; i < queues.size(); ++i){
+            WorkerQueue & victim = *queues[(thief + i) % queues.size()];
+            {
+                std::scoped_lock< std::mutex > lock(victim.mtx);
+                if (victim.tiles.empty()) continue;
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+            }
+
+            // halve along the longest side
+            Tile rest = tile;
+            if (tile.w >= tile.h && tile.w >= 2 * min_split_size){
+                tile.w /= 2;
+                rest.x += tile.w;
+                rest.w -= tile.w;
+            } else if (tile.h > tile.w && tile.h >= 2 * min_split_size){
+                tile.h /= 2;
+                rest.y += tile.h;
+                rest.h -= tile.h;
+            } else {
+                return true;
+            }
+            WorkerQueue & own = *queues[thief];
+            std::scoped_lock< std::mutex > lock(own.mtx);
+            own.tiles.push_front(rest);
+            return true;
+        }
+        return false;
+    }
+
+public:
+    TileScheduler(int image_w, int image_h, int tile_size, TileOrder tile_order, unsigned int n_workers, int min_split_size = 8)
+        : min_split_size(min_split_size) {
+
+        std::vector< Tile > tiles = splitInTiles(image_w, image_h, tile_size);
+        order(tiles, tile_order, image_w, image_h, tile_size);
+
+        // dealt round robin, so the workers all start at the beginning of the order
+        for (unsigned int i = 0; i < std::max(1u, n_workers); ++i) queues.push_back(std::make_unique< WorkerQueue >());
+        for (unsigned int i = 0; i < tiles.size(); ++i) queues[i % queues.size()]->tiles.push_back(tiles[i]);
+    }
+
+    // process(tile) on every tile, each of the pool's threads working through its own deque. Every pixel is in
+    // exactly one processed tile, splits included
+    void run(ThreadPool & pool, const std::function< void(const Tile &) > & process){
+        pool.parallelFor(queues.size(), [&](unsigned int worker){
+            Tile tile;
+            while (pop(worker, tile) || steal(worker, tile)) process(tile);
+        });
+    }
+};
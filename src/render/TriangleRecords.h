@@ -0,0 +1,149 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include "src/mesh/Triangle.h"
+#include "src/utils/Ray.h"
+#include "src/utils/Vec3.h"
+#include "src/utils/Simd.h"
+#include "src/utils/AlignedAllocator.h"
+
+
+// What the accelerators' leaves test instead of a Triangle. Möller-Trumbore only needs one vertex and the two
+// edges from it, so they're computed once at build time rather than at every test, plus the normal for
+// culling and shading. One array per coordinate (SoA), in the order of the structure's triangles, so a leaf's
+// triangles are tested simd::WIDTH at a time.
+// 13 floats per triangle, against ~84 bytes for a KdTriangle.
+class TriangleRecords {
+    // the ray in every lane, once per leaf
+    struct RayLanes {
+        simd::Float ox, oy, oz, dx, dy, dz;
+        explicit RayLanes(const Ray & r) :
+            ox(r.origin()[0]), oy(r.origin()[1]), oz(r.origin()[2]),
+            dx(r.direction()[0]), dy(r.direction()[1]), dz(r.direction()[2]) {}
+    };
+
+    unsigned int count = 0;
+
+public:
+    AlignedVector< float > v0[3];
+    AlignedVector< float > e1[3];
+    AlignedVector< float > e2[3];
+    AlignedVector< float > n[3];
+    AlignedVector< float > cull_backface; // 1 or 0, a float so it loads like the rest
+
+    size_t size() const { return count; }
+
+    void reserve(size_t size) {
+        for (int k = 0; k < 3; ++k){
+            v0[k].reserve(size + simd::WIDTH); e1[k].reserve(size + simd::WIDTH);
+            e2[k].reserve(size + simd::WIDTH); n[k].reserve(size + simd::WIDTH);
+        }
+        cull_backface.reserve(size + simd::WIDTH);
+    }
+
+    void push_back(const Triangle & t, bool cull) {
+        // every array keeps simd::WIDTH - 1 zeros after the last record, the last pack of a leaf can read that far.
+        // Zero edges are parallel to everything, they never hit
+        auto put = [this](AlignedVector< float > & array, float value){
+            array.resize(count + simd::WIDTH, 0.0f);
+            array[count] = value;
+        };
+
+        Vec3 edge1 = t[1] - t[0];
+        Vec3 edge2 = t[2] - t[0];
+        for (int k = 0; k < 3; ++k){
+            put(v0[k], t[0][k]);
+            put(e1[k], edge1[k]);
+            put(e2[k], edge2[k]);
+            put(n[k], t.normal()[k]);
+        }
+        put(cull_backface, cull ? 1.0f : 0.0f);
+        count++;
+    }
+
+    inline Vec3 normal(unsigned int i) const { return Vec3(n[0][i], n[1][i], n[2][i]); }
+
+    // Triangle::intersect on the simd::WIDTH records from first. Lanes that hit in ]0, inf[ are set, t holds their distance
+    inline simd::Mask intersectPack(unsigned int first, const RayLanes & r, bool use_cull, simd::Float & t) const {
+        using namespace simd;
+
+        Float e1x = Float::load(&e1[0][first]), e1y = Float::load(&e1[1][first]), e1z = Float::load(&e1[2][first]);
+        Float e2x = Float::load(&e2[0][first]), e2y = Float::load(&e2[1][first]), e2z = Float::load(&e2[2][first]);
+
+        // h = d x edge2
+        Float hx = r.dy * e2z - r.dz * e2y;
+        Float hy = r.dz * e2x - r.dx * e2z;
+        Float hz = r.dx * e2y - r.dy * e2x;
+        Float a = e1x * hx + e1y * hy + e1z * hz;
+
+        Mask ok = (a <= Float(-0.000001f)) | (a >= Float(0.000001f)); // Le rayon est parallèle au triangle.
+
+        if (use_cull){
+            Float n_dot_d = Float::load(&n[0][first]) * r.dx + Float::load(&n[1][first]) * r.dy + Float::load(&n[2][first]) * r.dz;
+            ok = andNot(ok, (Float::load(&cull_backface[first]) > Float(0.0f)) & (n_dot_d >= Float(0.0f)));
+        }
+
+        Float f = Float(1.0f) / a;
+        Float sx = r.ox - Float::load(&v0[0][first]);
+        Float sy = r.oy - Float::load(&v0[1][first]);
+        Float sz = r.oz - Float::load(&v0[2][first]);
+        Float u = f * (sx * hx + sy * hy + sz * hz);
+        ok = ok & (u >= Float(0.0f)) & (u <= Float(1.0f));
+
+        // q = s x edge1
+        Float qx = sy * e1z - sz * e1y;
+        Float qy = sz * e1x - sx * e1z;
+        Float qz = sx * e1y - sy * e1x;
+        Float v = f * (r.dx * qx + r.dy * qy + r.dz * qz);
+        ok = ok & (v >= Float(0.0f)) & (u + v <= Float(1.0f));
+
+        t = f * (e2x * qx + e2y * qy + e2z * qz);
+        return ok & (t > Float(0.0f));
+    }
+
+    // closest of the records [begin, end[ hit in [t_min, t_max[, culling the ones that want it.
+    // Returns its index and lowers t_max to its distance, -1 if none
+    inline int closestHit(unsigned int begin, unsigned int end, const Ray & ray, float t_min, float & t_max) const {
+        RayLanes r(ray);
+        int closest = -1;
+        for (unsigned int first = begin; first < end; first += simd::WIDTH){
+            simd::Float t;
+            simd::Mask hit = intersectPack(first, r, true, t);
+            int lanes = simd::bits(hit & simd::firstLanes(end - first) & (t >= simd::Float(t_min)) & (t < simd::Float(t_max)));
+            if (!lanes) continue;
+
+            float ts[simd::WIDTH];
+            t.store(ts);
+            for (int l = 0; l < simd::WIDTH; ++l){
+                if ((lanes >> l & 1) && ts[l] < t_max){
+                    t_max = ts[l];
+                    closest = first + l;
+                }
+            }
+        }
+        return closest;
+    }
+
+    // any record of [begin, end[ hit in ]t_min, t_max[, no culling (shadows)
+    inline bool anyHit(unsigned int begin, unsigned int end, const Ray & ray, float t_min, float t_max) const {
+        RayLanes r(ray);
+        for (unsigned int first = begin; first < end; first += simd::WIDTH){
+            simd::Float t;
+            simd::Mask hit = intersectPack(first, r, false, t);
+            if (simd::bits(hit & simd::firstLanes(end - first) & (t > simd::Float(t_min)) & (t < simd::Float(t_max)))) return true;
+        }
+        return false;
+    }
+
+    // what Triangle::intersect would have returned, only built for the hit that's kept
+    inline RayTriangleIntersection hit(unsigned int i, const Ray & ray, float t) const {
+        RayTriangleIntersection result;
+        result.intersectionExists = true;
+        result.t = t;
+        result.intersection = ray.at(t);
+        result.normal = normal(i);
+        result.uv = Vec2(0.0, 0.0);
+        return result;
+    }
+};
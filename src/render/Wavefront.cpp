@@ -0,0 +1,123 @@
+#include "Wavefront.h"
+
+#include <algorithm>
+#include <cfloat>
+
+
+void wavefront::sortRays(std::vector< Ray > & rays, std::vector< PathState > & paths){
+    Vec3 bounds_min(FLT_MAX);
+    Vec3 bounds_max(-FLT_MAX);
+    for (const Ray & r: rays){
+        for (int k = 0; k < 3; ++k){
+            bounds_min[k] = std::min(bounds_min[k], r.origin()[k]);
+            bounds_max[k] = std::max(bounds_max[k], r.origin()[k]);
+        }
+    }
+    Vec3 bounds_scale;
+    for (int k = 0; k < 3; ++k){
+        float extent = bounds_max[k] - bounds_min[k];
+        bounds_scale[k] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+    }
+
+    std::vector< std::pair< uint64_t, unsigned int > > keys(rays.size());
+    for (unsigned int i = 0; i < rays.size(); ++i) keys[i] = {rayKey(rays[i], bounds_min, bounds_scale), i};
+    std::sort(keys.begin(), keys.end());
+
+    std::vector< Ray > sorted_rays(rays.size());
+    std::vector< PathState > sorted_paths(paths.size());
+    for (unsigned int i = 0; i < keys.size(); ++i){
+        sorted_rays[i] = rays[keys[i].second];
+        sorted_paths[i] = paths[keys[i].second];
+    }
+    rays = std::move(sorted_rays);
+    paths = std::move(sorted_paths);
+}
+
+
+void wavefront::trace(const Scene & scene, const std::vector< Ray > & camera_rays, const std::vector< SampleStream > & streams, std::vector< RayResult > & results,
+    bool sort_secondary_rays){
+    results.assign(camera_rays.size(), RayResult());
+
+    std::vector< Ray > rays = camera_rays;
+    std::vector< PathState > paths(rays.size());
+    for (unsigned int i = 0; i < paths.size(); ++i) paths[i] = {i, true, true, streams[i]};
+
+    std::vector< Ray > next_rays;
+    std::vector< PathState > next_paths;
+
+    std::vector< RaySceneIntersection > hits;
+    std::vector< unsigned int > bin_of;     // per ray: 0 if it missed, material_id + 1 otherwise
+    std::vector< unsigned int > bin_start;  // bin b is order[bin_start[b], bin_start[b+1][
+    std::vector< unsigned int > order;
+    std::vector< float > lights_contrib(scene.lights.size());
+
+    const unsigned int n_bins = scene.materials.size() + 1;
+
+    for (int bounce = 0; bounce < MAX_BOUNCES && !rays.empty(); ++bounce){
+
+        // intersection: neighbouring rays in the queue make the packets, the camera rays' order is already a good one
+        if (sort_secondary_rays && bounce > 0) sortRays(rays, paths);
+
+        hits.resize(rays.size());
+        for (size_t first = 0; first < rays.size(); first += PACKET_SIZE){
+            int n = std::min< size_t >(PACKET_SIZE, rays.size() - first);
+            scene.computeIntersections(&rays[first], n, &hits[first]);
+        }
+
+        // binning, a counting sort of the rays by what they hit
+        bin_of.resize(rays.size());
+        bin_start.assign(n_bins + 1, 0);
+        for (size_t i = 0; i < rays.size(); ++i){
+            const RaySceneIntersection & hit = hits[i];
+            bin_of[i] = hit.intersectionExists ? scene.getMaterialId(hit.typeOfIntersectedObject, hit.objectIndex) + 1 : 0;
+            bin_start[bin_of[i] + 1]++;
+        }
+        for (unsigned int b = 0; b < n_bins; ++b) bin_start[b + 1] += bin_start[b];
+
+        order.resize(rays.size());
+        {
+            std::vector< unsigned int > fill(bin_start.begin(), bin_start.end() - 1);
+            for (unsigned int i = 0; i < rays.size(); ++i) order[fill[bin_of[i]]++] = i;
+        }
+
+        // shading, one material at a time. Misses end their path on the sky
+        next_rays.clear();
+        next_paths.clear();
+        for (unsigned int k = bin_start[0]; k < bin_start[1]; ++k){
+            unsigned int i = order[k];
+            RayResult & res = results[paths[i].result];
+            res.color += scene.skyColor(rays[i]);
+            if (paths[i].update_depth) res.depth = -1;
+        }
+
+        for (unsigned int b = 1; b < n_bins; ++b){
+            if (bin_start[b] == bin_start[b + 1]) continue;
+            const Material & mat = scene.getMaterial(b - 1);
+
+            for (unsigned int k = bin_start[b]; k < bin_start[b + 1]; ++k){
+                unsigned int i = order[k];
+                const Ray & ray = rays[i];
+                const RaySceneIntersection & hit = hits[i];
+                PathState path = paths[i];
+                RayResult & res = results[path.result];
+
+                res.color += scene.hitColor(ray, hit, mat, lights_contrib, path.stream);
+
+                if (path.update_depth) res.depth += hit.t;
+                if (path.update_normal) res.normal = hit.get_normal();
+
+                path.update_depth = path.update_depth && !mat.casts_shadows; // go through transparent materials?
+                path.update_normal = path.update_normal && !mat.casts_shadows;
+
+                Vec3 scatter_direction;
+                if (mat.scatter(ray.direction(), hit.get_normal(), scatter_direction)){
+                    next_rays.push_back(Ray(hit.get_position(), scatter_direction));
+                    next_paths.push_back(path);
+                }
+            }
+        }
+
+        std::swap(rays, next_rays);
+        std::swap(paths, next_paths);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "src/utils/Ray.h"
+#include "Scene.h"
+#include "Sampler.h"
+
+
+// Breadth first version of Scene::rayTrace over a whole batch of camera rays: every bounce is one pass over all
+// the paths still going. A pass intersects all of its rays (by packets), bins their hits by material, then shades
+// the hits one material at a time, which writes the next generation of rays in a new queue.
+// Same results as rayTrace, up to the order the contributions are summed and the random numbers are drawn.
+namespace wavefront{
+
+static const int MAX_BOUNCES = 100; // as in Scene::rayTrace
+
+// rays traced at once by the renderer, with their intersections that's already a few MB per thread
+static const unsigned int BATCH_SIZE = 1 << 14;
+
+// what a ray in a queue carries besides itself
+struct PathState {
+    unsigned int result; // index in results
+    bool update_depth;
+    bool update_normal;
+    SampleStream stream; // carried on by the scattered ray
+};
+
+// where a ray goes in a sorted queue: its direction's octant first, then the Morton code of its origin in bounds.
+// Neighbouring keys start close to each other and go the same way, so they walk the same nodes
+inline uint64_t rayKey(const Ray & r, const Vec3 & bounds_min, const Vec3 & bounds_scale){
+    uint64_t octant = (r.direction()[0] < 0) | (r.direction()[1] < 0) << 1 | (r.direction()[2] < 0) << 2;
+
+    // 10 bits per axis, interleaved
+    uint64_t morton = 0;
+    for (int k = 0; k < 3; ++k){
+        uint64_t q = std::min(1023.0f, std::max(0.0f, (r.origin()[k] - bounds_min[k]) * bounds_scale[k]));
+        for (int bit = 0; bit < 10; ++bit) morton |= (q >> bit & 1) << (3 * bit + k);
+    }
+    return octant << 30 | morton;
+}
+
+// reorders the queue by rayKey
+void sortRays(std::vector< Ray > & rays, std::vector< PathState > & paths);
+
+// results[i] gets what scene.rayTrace(rays[i], streams[i]) would return.
+// With sort_secondary_rays the bounces' queues are sorted (sortRays) before being intersected, the camera rays are
+// already coherent
+void trace(const Scene & scene, const std::vector< Ray > & rays, const std::vector< SampleStream > & streams, std::vector< RayResult > & results,
+    bool sort_secondary_rays = false);
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+#include <new>
+#include <cstddef>
+
+
+// std::vector storage starting on a 32 bytes boundary, so an array can be read a whole AVX register at a time
+template< class T, std::size_t ALIGNMENT = 32 >
+struct AlignedAllocator {
+    using value_type = T;
+    template< class U > struct rebind { using other = AlignedAllocator< U, ALIGNMENT >; };
+
+    AlignedAllocator() = default;
+    template< class U > AlignedAllocator(const AlignedAllocator< U, ALIGNMENT > &) {}
+
+    T * allocate(std::size_t n) { return static_cast< T * >(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT))); }
+    void deallocate(T * p, std::size_t) { ::operator delete(p, std::align_val_t(ALIGNMENT)); }
+
+    bool operator==(const AlignedAllocator &) const { return true; }
+    bool operator!=(const AlignedAllocator &) const { return false; }
+};
+
+template< class T >
+using AlignedVector = std::vector< T, AlignedAllocator< T > >;
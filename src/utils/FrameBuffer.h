@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "src/utils/Vec3.h"
+#include "src/utils/Color.h"
+#include "src/utils/AlignedAllocator.h"
+
+
+// A w x h image of linear RGB floats, what the renderer and the post effects work on. Nothing is clamped or
+// quantized until the image leaves the renderer (toColors), so values over 1 make it through the whole pipeline.
+// One plane per channel (SoA), each starting on a 32 bytes boundary
+class FrameBuffer {
+    AlignedVector< float > r, g, b;
+
+public:
+    int w = 0;
+    int h = 0;
+
+    FrameBuffer() = default;
+    FrameBuffer(int width, int height, const Vec3 & value = Vec3(0, 0, 0))
+        : r(width * height, value[0]), g(width * height, value[1]), b(width * height, value[2]), w(width), h(height) {}
+
+    size_t size() const { return r.size(); }
+
+    Vec3 get(int p) const { return Vec3(r[p], g[p], b[p]); }
+    void set(int p, const Vec3 & c){
+        r[p] = c[0];
+        g[p] = c[1];
+        b[p] = c[2];
+    }
+
+    float * channel(int k){ return k == 0 ? r.data() : k == 1 ? g.data() : b.data(); }
+    const float * channel(int k) const { return k == 0 ? r.data() : k == 1 ? g.data() : b.data(); }
+
+    // 8 bits per channel, interleaved, for display and export
+    void toColors(std::vector< Color > & out) const {
+        out.resize(size());
+        for (size_t p = 0; p < size(); ++p) out[p] = Color(get(p));
+    }
+};
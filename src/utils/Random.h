@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+
+// Random number generators small enough to make one wherever it's needed, instead of a 2.5 KB mt19937 per thread
+
+
+// in [0, 1[ from the top 24 bits, so it can't round up to 1
+inline float toUnitFloat(uint32_t x){
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+
+// Philox4x32-10 (Salmon et al. 2011), counter based: four random words that only depend on the counter and the key.
+// Nothing to carry around or seed, the n-th number of a stream is philox(n, stream) whichever thread draws it
+inline std::array< uint32_t, 4 > philox4x32(std::array< uint32_t, 4 > counter, std::array< uint32_t, 2 > key){
+    const uint32_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+    const uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+    for (int round = 0; round < 10; ++round){
+        if (round > 0){
+            key[0] += W0;
+            key[1] += W1;
+        }
+        uint64_t p0 = (uint64_t)M0 * counter[0];
+        uint64_t p1 = (uint64_t)M1 * counter[2];
+        counter = {
+            (uint32_t)(p1 >> 32) ^ counter[1] ^ key[0], (uint32_t)p1,
+            (uint32_t)(p0 >> 32) ^ counter[3] ^ key[1], (uint32_t)p0
+        };
+    }
+    return counter;
+}
+
+
+// PCG32 (O'Neill 2014), 16 bytes of state. Different streams from the same seed are independent sequences
+class Pcg32 {
+    uint64_t state = 0;
+    uint64_t increment;
+
+public:
+    explicit Pcg32(uint64_t seed, uint64_t stream = 0) : increment(stream << 1 | 1) {
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next(){
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rotation = (uint32_t)(old >> 59);
+        return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+    }
+
+    float nextFloat(){ return toUnitFloat(next()); }
+};
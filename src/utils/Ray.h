@@ -3,8 +3,8 @@
 #include "src/utils/Line.h"
 class Ray : public Line {
 public:
-    Vec3 invdir; // used for aabb testing
+    Vec3 invdir; // used for aabb testing. From the normalized direction, so slab distances are real distances
     Ray() : Line() {}
-    Ray( Vec3 const & o , Vec3 const & d ) : Line(o,d), invdir(1.0 / d[0],1.0 / d[1],1.0 / d[2] ) {}
+    Ray( Vec3 const & o , Vec3 const & d ) : Line(o,d), invdir(1.0 / direction()[0],1.0 / direction()[1],1.0 / direction()[2] ) {}
 };
 #endif
@@ -0,0 +1,127 @@
+#pragma once
+
+// Just enough of a SIMD float type to write a kernel once for every target: 8 lanes with AVX, 4 with SSE2
+// (always there on x86-64), and a plain float otherwise. Picked at compile time, build with -mavx2
+// (or -march=native) to get the wide one.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace simd{
+
+#if defined(__AVX__)
+
+static const int WIDTH = 8;
+
+struct Mask { __m256 v; };
+
+struct Float {
+    __m256 v;
+    Float() = default;
+    Float(__m256 x) : v(x) {}
+    explicit Float(float x) : v(_mm256_set1_ps(x)) {}
+
+    static inline Float load(const float * p) { return _mm256_loadu_ps(p); }
+    inline void store(float * p) const { _mm256_storeu_ps(p, v); }
+    static inline Float lanes() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+};
+
+inline Float operator+(Float a, Float b) { return _mm256_add_ps(a.v, b.v); }
+inline Float operator-(Float a, Float b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float operator*(Float a, Float b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float operator/(Float a, Float b) { return _mm256_div_ps(a.v, b.v); }
+inline Float min(Float a, Float b) { return _mm256_min_ps(a.v, b.v); }
+inline Float max(Float a, Float b) { return _mm256_max_ps(a.v, b.v); }
+
+inline Mask operator<(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+inline Mask operator<=(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline Mask operator>(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+inline Mask operator>=(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+
+inline Mask operator&(Mask a, Mask b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline Mask operator|(Mask a, Mask b) { return {_mm256_or_ps(a.v, b.v)}; }
+inline Mask andNot(Mask a, Mask b) { return {_mm256_andnot_ps(b.v, a.v)}; } // a and not b
+
+inline int bits(Mask m) { return _mm256_movemask_ps(m.v); } // bit i set if lane i is
+inline Float select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b.v, a.v, m.v); } // m ? a : b
+
+#elif defined(__SSE2__)
+
+static const int WIDTH = 4;
+
+struct Mask { __m128 v; };
+
+struct Float {
+    __m128 v;
+    Float() = default;
+    Float(__m128 x) : v(x) {}
+    explicit Float(float x) : v(_mm_set1_ps(x)) {}
+
+    static inline Float load(const float * p) { return _mm_loadu_ps(p); }
+    inline void store(float * p) const { _mm_storeu_ps(p, v); }
+    static inline Float lanes() { return _mm_setr_ps(0, 1, 2, 3); }
+};
+
+inline Float operator+(Float a, Float b) { return _mm_add_ps(a.v, b.v); }
+inline Float operator-(Float a, Float b) { return _mm_sub_ps(a.v, b.v); }
+inline Float operator*(Float a, Float b) { return _mm_mul_ps(a.v, b.v); }
+inline Float operator/(Float a, Float b) { return _mm_div_ps(a.v, b.v); }
+inline Float min(Float a, Float b) { return _mm_min_ps(a.v, b.v); }
+inline Float max(Float a, Float b) { return _mm_max_ps(a.v, b.v); }
+
+inline Mask operator<(Float a, Float b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+inline Mask operator<=(Float a, Float b) { return {_mm_cmple_ps(a.v, b.v)}; }
+inline Mask operator>(Float a, Float b) { return {_mm_cmpgt_ps(a.v, b.v)}; }
+inline Mask operator>=(Float a, Float b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+
+inline Mask operator&(Mask a, Mask b) { return {_mm_and_ps(a.v, b.v)}; }
+inline Mask operator|(Mask a, Mask b) { return {_mm_or_ps(a.v, b.v)}; }
+inline Mask andNot(Mask a, Mask b) { return {_mm_andnot_ps(b.v, a.v)}; }
+
+inline int bits(Mask m) { return _mm_movemask_ps(m.v); }
+inline Float select(Mask m, Float a, Float b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); } // no blendv before SSE4.1
+
+#else
+
+static const int WIDTH = 1;
+
+struct Mask { bool v; };
+
+struct Float {
+    float v;
+    Float() = default;
+    explicit Float(float x) : v(x) {}
+
+    static inline Float load(const float * p) { return Float(*p); }
+    inline void store(float * p) const { *p = v; }
+    static inline Float lanes() { return Float(0.0f); }
+};
+
+inline Float operator+(Float a, Float b) { return Float(a.v + b.v); }
+inline Float operator-(Float a, Float b) { return Float(a.v - b.v); }
+inline Float operator*(Float a, Float b) { return Float(a.v * b.v); }
+inline Float operator/(Float a, Float b) { return Float(a.v / b.v); }
+inline Float min(Float a, Float b) { return Float(a.v < b.v ? a.v : b.v); }
+inline Float max(Float a, Float b) { return Float(a.v > b.v ? a.v : b.v); }
+
+inline Mask operator<(Float a, Float b) { return {a.v < b.v}; }
+inline Mask operator<=(Float a, Float b) { return {a.v <= b.v}; }
+inline Mask operator>(Float a, Float b) { return {a.v > b.v}; }
+inline Mask operator>=(Float a, Float b) { return {a.v >= b.v}; }
+
+inline Mask operator&(Mask a, Mask b) { return {a.v && b.v}; }
+inline Mask operator|(Mask a, Mask b) { return {a.v || b.v}; }
+inline Mask andNot(Mask a, Mask b) { return {a.v && !b.v}; }
+
+inline int bits(Mask m) { return m.v ? 1 : 0; }
+inline Float select(Mask m, Float a, Float b) { return m.v ? a : b; }
+
+#endif
+
+// lanes [0, n[ set
+inline Mask firstLanes(int n) { return Float::lanes() < Float((float)n); }
+
+}
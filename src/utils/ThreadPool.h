@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+
+// Workers started once and kept for the whole run, instead of a thread per tile at every render.
+// parallelFor hands out the indices of a job one at a time from a shared counter, whoever is free takes the next
+// one, so there are never more threads running than cores. The calling thread works on its own job too, which
+// also makes nested or concurrent parallelFor calls safe: a job always progresses, even with every worker busy.
+class ThreadPool {
+    struct Job {
+        const std::function< void(unsigned int) > * task;
+        unsigned int n_tasks;
+        std::atomic< unsigned int > next{0};
+        unsigned int users = 0; // workers in runTasks, under mtx
+    };
+
+    std::vector< std::thread > workers;
+    std::deque< Job * > jobs; // with tasks left to hand out, oldest first
+
+    std::mutex mtx;
+    std::condition_variable job_available;
+    std::condition_variable job_left;
+    bool stop = false;
+
+    static void runTasks(Job & job){
+        unsigned int i;
+        while ((i = job.next++) < job.n_tasks) (*job.task)(i);
+    }
+
+    void workerLoop(){
+        std::unique_lock< std::mutex > lock(mtx);
+        while (true){
+            job_available.wait(lock, [this]{ return stop || !jobs.empty(); });
+            if (stop) return;
+
+            Job * job = jobs.front();
+            if (job->next >= job->n_tasks){ // all handed out, its caller waits for the last ones
+                jobs.pop_front();
+                continue;
+            }
+
+            job->users++;
+            lock.unlock();
+            runTasks(*job);
+            lock.lock();
+            if (--job->users == 0) job_left.notify_all();
+        }
+    }
+
+public:
+    // n_workers besides the threads calling parallelFor
+    explicit ThreadPool(unsigned int n_workers){
+        for (unsigned int i = 0; i < n_workers; ++i) workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+
+    ~ThreadPool(){
+        {
+            std::scoped_lock< std::mutex > lock(mtx);
+            stop = true;
+        }
+        job_available.notify_all();
+        for (std::thread & t: workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    unsigned int size() const { return workers.size() + 1; }
+
+    // task(i) for every i in [0, n_tasks[, returns once they are all done
+    void parallelFor(unsigned int n_tasks, const std::function< void(unsigned int) > & task){
+        if (n_tasks == 0) return;
+
+        Job job;
+        job.task = &task;
+        job.n_tasks = n_tasks;
+        {
+            std::scoped_lock< std::mutex > lock(mtx);
+            jobs.push_back(&job);
+        }
+        job_available.notify_all();
+
+        runTasks(job);
+
+        // every task is handed out, no one can pick the job anymore once it's off the queue.
+        // It lives on this stack: wait for the workers still in it
+        std::unique_lock< std::mutex > lock(mtx);
+        auto it = std::find(jobs.begin(), jobs.end(), &job);
+        if (it != jobs.end()) jobs.erase(it);
+        job_left.wait(lock, [&job]{ return job.users == 0; });
+    }
+
+    // the one the renderers and post effects share, a worker per core besides the caller
+    static ThreadPool & shared(){
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+};
@@ -182,7 +182,7 @@ public:
 
     // Multiplication de matrice avec un Vec3 : m.p
     //--> application d'un matrice de rotation à un point ou un vecteur
-    Vec3 operator*(const Vec3 &p) {
+    Vec3 operator*(const Vec3 &p) const {
         //Pour acceder a un element de la matrice (*this)(i,j) et du point p[i]
         Vec3 res = Vec3(
                     (*this)(0, 0) * p[0] + (*this)(0, 1) * p[1] + (*this)(0, 2) * p[2],
@@ -191,7 +191,7 @@ public:
         return res;
     }
 
-    Mat3 operator*(const Mat3 &m2) { // calcul du produit matriciel m1.m2
+    Mat3 operator*(const Mat3 &m2) const { // calcul du produit matriciel m1.m2
         //Pour acceder a un element de la premiere matrice (*this)(i,j) et de la deuxième m2(k,l)
         Mat3 res = Mat3(
                     (*this)(0, 0) * m2(0, 0) + (*this)(0, 1) * m2(1, 0) + (*this)(0, 2) * m2(2, 0),
@@ -300,6 +300,23 @@ public:
         return Mat3(-vals[0], -vals[1], -vals[2], -vals[3], -vals[4], -vals[5], -vals[6], -vals[7], -vals[8]);
     }
 
+    ////////        INVERSE       /////////
+    // adjugate over determinant, the caller makes sure the matrix isn't singular
+    Mat3 getInverse() const {
+        float inv_det = 1.0f / determinant();
+        return Mat3(
+            (vals[4] * vals[8] - vals[5] * vals[7]) * inv_det,
+            (vals[2] * vals[7] - vals[1] * vals[8]) * inv_det,
+            (vals[1] * vals[5] - vals[2] * vals[4]) * inv_det,
+            (vals[5] * vals[6] - vals[3] * vals[8]) * inv_det,
+            (vals[0] * vals[8] - vals[2] * vals[6]) * inv_det,
+            (vals[2] * vals[3] - vals[0] * vals[5]) * inv_det,
+            (vals[3] * vals[7] - vals[4] * vals[6]) * inv_det,
+            (vals[1] * vals[6] - vals[0] * vals[7]) * inv_det,
+            (vals[0] * vals[4] - vals[1] * vals[3]) * inv_det
+        );
+    }
+
 
 private:
     float vals[9];
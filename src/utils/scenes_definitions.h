@@ -1,6 +1,7 @@
 #pragma once
 
 #include "src/render/Scene.h"
+#include <future>
 
 
 static Scene sphere_and_plane() {
@@ -61,7 +62,7 @@ static Scene sphere_and_plane() {
         light.material = Vec3(1,1,1);
         light.isInCamSpace = false;
     }
-    scene.generateKdTree();
+    scene.generateAccelerationStructure(AccelerationType_BVH);
     return scene;
 }
 
@@ -194,7 +195,79 @@ static Scene mesh_with_kdTree() {
 
 
 
-        scene.generateKdTree();
+        scene.generateAccelerationStructure(AccelerationType_BVH);
+        return scene;
+}
+
+static Scene dragon_herd() {
+
+        Scene scene;
+        scene.name = "Dragons! (instances)";
+
+        //materials
+
+        int mat = scene.addMaterial(
+            PhongMaterial::create(
+                Vec3( 0.0,0.0,0.0 ), Vec3( 1.0,0.4,0.55 ), Vec3( 0.2,0.2,0.2 ), 5.0
+            )
+        );
+
+        int otherMat = scene.addMaterial(
+            PhongMaterial::create(
+                Vec3( 0.0,0.0,0.0 ), Vec3( 0.4,0.55,1.0 ), Vec3( 0.2,0.2,0.2 ), 5.0
+            )
+        );
+
+        int planeMat = scene.addMaterial(
+            PhongMaterial::create(
+                Vec3( 0.0,0.0,0.0 ), Vec3( 0.6,0.6,0.6 ), Vec3( 0.1,0.1,0.1 ), 1.0
+            )
+        );
+
+        {
+            scene.lights.resize( scene.lights.size() + 1 );
+            Light & light = scene.lights[scene.lights.size() - 1];
+            light.pos = Vec3(-3,6,3);
+            light.radius = 2.5f;
+            light.powerCorrection = 20.f;
+            light.type = LightType_Spherical;
+            light.material = Vec3(1,1,1);
+            light.isInCamSpace = false;
+        }
+
+        {
+        scene.squares.resize( scene.squares.size() + 1 );
+        Square & s = scene.squares[scene.squares.size() - 1];
+        s.setQuad(Vec3(-1., -1., 0.), Vec3(1., 0, 0.), Vec3(0., 1, 0.), 2., 2.);
+        s.translate(Vec3(0., 0., -1.1));
+        s.scale(Vec3(12., 12., 1.));
+        s.rotate_x(-90);
+        s.build_arrays();
+        s.recomputeVectors();
+        s.material_id = planeMat;
+        }
+
+        // a single copy of the dragon's triangles, 25 of them in the scene
+        Mesh mesh;
+        mesh.loadOFF("./models/xyzrgb_dragon_100k.off");
+        mesh.build_arrays();
+        mesh.material_id = mat;
+        int dragon = scene.addPrototype(mesh);
+
+        for (int i = 0; i < 5; ++i){
+            for (int j = 0; j < 5; ++j){
+                scene.instances.resize( scene.instances.size() + 1 );
+                MeshInstance & instance = scene.instances[scene.instances.size() - 1];
+                instance.prototype = dragon;
+                float size = 0.015 + 0.002 * ((i + j) % 3);
+                instance.scale(Vec3(size));
+                instance.rotate_y(37.0 * (i * 5 + j));
+                instance.translate(Vec3(-8.0 + 4.0 * i, -1.1 - mesh.AABB_v1[1] * size, -8.0 + 4.0 * j)); // feet on the ground
+                instance.material_id = (i + j) % 2 ? otherMat : mat;
+            }
+        }
+
+        scene.generateAccelerationStructure(AccelerationType_BVH);
         return scene;
 }
 
@@ -342,7 +415,7 @@ static Scene cornell_box(){
         s.material_id = mirrorMat;
     }
 
-
+    scene.generateAccelerationStructure(AccelerationType_BVH);
     return scene;
 }
 
@@ -480,7 +553,7 @@ Scene cornell_box_textured(){
     scene.meshes.push_back(mesh); // copy but don't care
     
     
-    scene.generateKdTree();
+    scene.generateAccelerationStructure(AccelerationType_BVH);
     return scene;
 }
 
@@ -636,7 +709,7 @@ Scene flamant(){
     }
 
     
-    scene.generateKdTree();
+    scene.generateAccelerationStructure(AccelerationType_BVH);
     return scene;
 }
 
@@ -651,13 +724,16 @@ std::vector<Scene> getScenes(){
     };
     */
 
-     std::vector<Scene> res;
-    res.push_back(sphere_and_plane());
-    res.push_back(mesh());
-    res.push_back(mesh_kd1());
-    res.push_back(mesh_with_kdTree());
-    res.push_back(cornell_box());
-    res.push_back(cornell_box_textured());
-    res.push_back(flamant());
+    // the scenes don't share anything, so loading files and building trees can all happen at once
+    // (the builds' own threads all come from buildThreads, it's not a thread per core for each scene)
+    std::vector< std::future<Scene> > loading;
+    for (Scene (*scene_function)(): {
+            sphere_and_plane, mesh, mesh_kd1, mesh_with_kdTree, dragon_herd, cornell_box, cornell_box_textured, flamant
+        }){
+        loading.push_back(std::async(std::launch::async, scene_function));
+    }
+
+    std::vector<Scene> res;
+    for (std::future<Scene> & scene: loading) res.push_back(scene.get()); // same order as above
     return res;
 }
\ No newline at end of file
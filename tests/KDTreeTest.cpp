@@ -0,0 +1,99 @@
+// make test
+#include <iostream>
+#include <cmath>
+#include "src/render/KDTree.h"
+
+
+static int failures = 0;
+
+static void check(bool ok, const std::string & what){
+    if (!ok){
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+
+// n x n quads on the z = 0 plane, from (0, 0) to (n, n)
+static Mesh flatGrid(int n){
+    Mesh mesh;
+    for (int y = 0; y <= n; ++y){
+        for (int x = 0; x <= n; ++x) mesh.vertices.push_back(MeshVertex(Vec3(x, y, 0), Vec3(0, 0, 1)));
+    }
+    for (int y = 0; y < n; ++y){
+        for (int x = 0; x < n; ++x){
+            unsigned int v = x + y * (n + 1);
+            mesh.triangles.push_back(MeshTriangle(v, v + 1, v + n + 2));
+            mesh.triangles.push_back(MeshTriangle(v, v + n + 2, v + n + 1));
+        }
+    }
+    mesh.cull_backfaces = false;
+    return mesh;
+}
+
+
+// every leaf has triangles in range, every interior node's second child comes after it
+static void checkNodes(const KDTree & tree, const std::string & name){
+    for (unsigned int i = 0; i < tree.nodes.size(); ++i){
+        const auto & node = tree.nodes[i];
+        if (node.is_leaf()){
+            check(node.offset + node.n_tris <= tree.leaf_tris.size(), name + ": leaf range");
+        } else {
+            check(i + 1 < tree.nodes.size() && node.offset > i + 1 && node.offset < tree.nodes.size(), name + ": interior node children");
+        }
+    }
+}
+
+
+static void testFlatGrid(KDTree::BuildMode mode, const std::string & name){
+    const int n = 40;
+    std::vector< Mesh > meshes = {flatGrid(n)};
+    KDTree tree(meshes, mode);
+
+    check(!tree.nodes.empty(), name + ": built");
+    checkNodes(tree, name);
+
+    // straight down on every quad, and a bit slanted
+    for (int y = 0; y < n; ++y){
+        for (int x = 0; x < n; ++x){
+            Vec3 target(x + 0.3f, y + 0.6f, 0.0f);
+            for (const Vec3 & origin: {target + Vec3(0, 0, 1), target + Vec3(0.5f, -0.25f, 2)}){
+                Vec3 d = target - origin;
+                float dist = d.length();
+                d.normalize();
+                Ray r(origin, d);
+                RaySceneIntersection hit = tree.getIntersection(r);
+                check(hit.intersectionExists && std::fabs(hit.t - dist) < 1e-3f, name + ": ray down on the grid");
+                check(tree.hasIntersection(r, dist + 1.0f), name + ": occlusion ray on the grid");
+            }
+        }
+    }
+
+    // beside it, and parallel to it
+    Vec3 down(0, 0, -1);
+    check(!tree.getIntersection(Ray(Vec3(-1, -1, 1), down)).intersectionExists, name + ": ray beside the grid");
+    check(!tree.getIntersection(Ray(Vec3(n + 1, 5, 1), down)).intersectionExists, name + ": ray beside the grid");
+    check(!tree.hasIntersection(Ray(Vec3(-1, 5, 1), Vec3(1, 0, 0)), 1000.0f), name + ": ray above the grid");
+}
+
+
+static void testEmpty(){
+    KDTree tree(std::vector< Mesh >(), KDTree::BuildMode_SAH);
+    Ray r(Vec3(0, 0, 1), Vec3(0, 0, -1));
+    check(!tree.getIntersection(r).intersectionExists, "empty: no hit");
+    check(!tree.hasIntersection(r, 1000.0f), "empty: no occlusion");
+}
+
+
+int main(){
+    testFlatGrid(KDTree::BuildMode_MeanSplit, "flat grid, mean split");
+    testFlatGrid(KDTree::BuildMode_SAH, "flat grid, SAH");
+    testEmpty();
+
+    if (failures > 0){
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "KDTree: all checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,84 @@
+// make test
+#include <iostream>
+#include <string>
+#include <vector>
+#include "src/render/Sampler.h"
+
+
+static int failures = 0;
+
+static void check(bool ok, const std::string & what){
+    if (!ok){
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+
+static const char * const NAMES[] = {"independent", "stratified", "sobol", "blue noise"};
+static const int N_SAMPLES = 64;
+// 64 points on a line, even wrapped around, are in 16 of the 64 cells at most. Random points are in about 40
+static const int MIN_CELLS = 24;
+
+
+// the dimensions' values of one pixel's samples cover the cube they're in, they're not all on a line
+static int occupiedCells(const Sampler & sampler, uint32_t pixel, const std::vector< uint32_t > & dimensions){
+    int cells_per_axis = dimensions.size() == 2 ? 8 : 4;
+    std::vector< bool > occupied(N_SAMPLES, false);
+    for (uint32_t s = 0; s < N_SAMPLES; ++s){
+        int cell = 0;
+        for (uint32_t d: dimensions) cell = cell * cells_per_axis + (int)(sampler.get(pixel, s, d) * cells_per_axis);
+        occupied[cell] = true;
+    }
+    int n = 0;
+    for (bool o: occupied) n += o;
+    return n;
+}
+
+
+static void testSpread(SamplerType type){
+    const int width = 32;
+    Sampler sampler(type, N_SAMPLES, width);
+    const std::vector< std::vector< uint32_t > > dimension_sets = {
+        {0, 1}, {2, 3}, {0, 4}, {1, 5}, // a 2D jitter, and the same dimension in two groups
+        {0, 1, 2}, {4, 5, 6}            // a light target
+    };
+    for (uint32_t pixel: {0u, 1u, 33u, 517u}){
+        for (const std::vector< uint32_t > & dimensions: dimension_sets){
+            int n = occupiedCells(sampler, pixel, dimensions);
+            std::string name = std::string(NAMES[type]) + ", pixel " + std::to_string(pixel) + ", dimensions";
+            for (uint32_t d: dimensions) name += " " + std::to_string(d);
+            check(n >= MIN_CELLS, name + ": samples in " + std::to_string(n) + " cells");
+        }
+    }
+}
+
+
+static void testRange(SamplerType type){
+    Sampler sampler(type, 16, 32);
+    bool ok = true;
+    for (uint32_t pixel = 0; pixel < 64; ++pixel){
+        for (uint32_t s = 0; s < 40; ++s){
+            for (uint32_t d = 0; d < 12; ++d){
+                float v = sampler.get(pixel, s, d);
+                ok = ok && v >= 0.0f && v < 1.0f;
+            }
+        }
+    }
+    check(ok, std::string(NAMES[type]) + ": values in [0, 1[");
+}
+
+
+int main(){
+    for (SamplerType type: {SamplerType_Independent, SamplerType_Stratified, SamplerType_Sobol, SamplerType_BlueNoise}){
+        testSpread(type);
+        testRange(type);
+    }
+
+    if (failures > 0){
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "Sampler: all checks passed" << std::endl;
+    return 0;
+}